@@ -15,6 +15,12 @@ DebuggerGui::DebuggerGui():d_status(Idle),d_curThread(0),d_byteLevel(false),d_ro
     d_dbg = new Debugger(this);
     const quint16 port = d_dbg->open();
     qDebug() << "debugger port" << port;
+    const QByteArray log = qgetenv("MONO_DEBUGGER_LOG");
+    if( !log.isEmpty() )
+        d_dbg->record( QString::fromLocal8Bit(log) ); // for MonoDebuggerBench -replay
+    const QByteArray cache = qgetenv("MONO_DEBUGGER_CACHE");
+    if( !cache.isEmpty() )
+        d_dbg->setCacheDir( QString::fromLocal8Bit(cache) );
 
     d_eng = new Engine(this);
 
@@ -96,27 +102,30 @@ void DebuggerGui::onExit()
 void DebuggerGui::onGetThreads()
 {
     ENABLED_IF(d_status != Idle);
-    d_threads = d_dbg->allThreads();
+    const QList<Debugger::ThreadInfo> threads = d_dbg->getThreadSnapshot(1);
+    d_threads.clear();
     qDebug() << "*** thread list";
-    foreach( quint32 t, d_threads )
-        qDebug() << t << d_dbg->getThreadName(t) << Debugger::s_state[d_dbg->getThreadState(t)];
+    foreach( const Debugger::ThreadInfo& t, threads )
+    {
+        d_threads << t.id;
+        if( t.top.isEmpty() )
+            qDebug() << t.id << t.tid << t.name << Debugger::s_state[t.state];
+        else
+            qDebug() << t.id << t.tid << t.name << Debugger::s_state[t.state] << d_dbg->getMethodName(t.top.first().method);
+    }
 }
 
 void DebuggerGui::onGetStack()
 {
     ENABLED_IF(d_status != Idle && d_curThread != 0);
 
-    QList<Debugger::Frame> stack = d_dbg->getStack(d_curThread);
+    const QList<Debugger::SymbolFrame> stack = d_dbg->getSymbolicatedStack(d_curThread);
     qDebug() << "*** stack of thread" << d_curThread;
     for( int i = 0; i < stack.size(); i++ )
     {
-        // QByteArray bytes = d_dbg->getMethodBody(stack[i].method).toHex();
-        const quint32 type = d_dbg->getMethodOwner(stack[i].method);
-        Debugger::TypeInfo info = d_dbg->getTypeInfo(type);
-        Debugger::MethodDbgInfo meth = d_dbg->getMethodInfo(stack[i].method);
-        qDebug() << i << info.fullName << d_dbg->getMethodName(stack[i].method) << stack[i].il_offset
-                 << meth.codeSize << d_dbg->getMethodKind(stack[i].method) << d_dbg->isMethodStatic(stack[i].method)
-                 << meth.sourceFile << meth.lines.size();
+        const Debugger::SymbolFrame& f = stack[i];
+        qDebug() << i << f.type.fullName << f.name << f.frame.il_offset
+                 << f.sourceFile << f.loc.row << f.loc.col;
     }
 }
 
@@ -192,20 +201,18 @@ void DebuggerGui::onLocals()
 {
     ENABLED_IF(d_status != Idle);
 
-    QList<Debugger::Frame> stack = d_dbg->getStack(d_curThread);
+    QList<Debugger::Frame> stack = d_dbg->getStack(d_curThread, 0, 1);
     if( stack.isEmpty() )
         return;
-    const bool isStatic = d_dbg->isMethodStatic(stack.first().method);
-    const quint16 params = d_dbg->getParamCount(stack.first().method);
-    const quint16 locals = d_dbg->getLocalsCount(stack.first().method);
-    QVariantList vals = d_dbg->getParamValues(d_curThread,stack.first().id,!isStatic,params);
+    const Debugger::FrameSnapshot snap = d_dbg->getFrameSnapshot(d_curThread,stack.first());
     qDebug() << "*** Params:";
-    for( int i = 0; i < vals.size(); i++ )
-        qDebug() << toString(vals[i]).toUtf8().constData();
+    if( snap.hasThis )
+        qDebug() << snap.self.name.constData() << toString(snap.self.value).toUtf8().constData();
+    for( int i = 0; i < snap.params.size(); i++ )
+        qDebug() << snap.params[i].name.constData() << toString(snap.params[i].value).toUtf8().constData();
     qDebug() << "*** Locals:";
-    vals = d_dbg->getLocalValues(d_curThread,stack.first().id,locals);
-    for( int i = 0; i < vals.size(); i++ )
-        qDebug() << toString(vals[i]).toUtf8().constData();
+    for( int i = 0; i < snap.locals.size(); i++ )
+        qDebug() << snap.locals[i].name.constData() << toString(snap.locals[i].value).toUtf8().constData();
 
 }
 
@@ -1,6 +1,15 @@
 #include "MonoDebugger.h"
 #include "MonoDebuggerPrivate.h"
+#include "MonoDebuggerCodec.h"
 #include <QEventLoop>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSet>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QTimer>
@@ -26,9 +35,17 @@
 
 #include <QCoreApplication>
 #include <limits>
-#include <QDateTime>
 using namespace Mono;
 
+static const int s_defaultTimeout = 20000; // msecs
+static const int s_ringSize = 0x10000; // initial receive buffer size, must be a power of two
+static const int s_slotCount = 256; // max. number of requests in flight, must be a power of two
+static const int s_stringCacheSize = 0x100000; // bytes
+static const int s_traceBufferSize = 10000; // records
+static const char s_logMagic[] = "MDWPLOG1";
+static const quint32 s_storeMagic = 0x4d444332; // "MDC2"
+enum LogKind { LogRequest, LogReply, LogEvent };
+
 const char* DebuggerEvent::s_event[] = {
     "VM_START",
     "VM_DEATH",
@@ -154,6 +171,15 @@ static inline void writeUint64( char* buf, quint64 val )
     buf[7] = (val >> 0) & 0xff;
 }
 
+static inline void writeHeader( char* buf, quint32 len, quint32 id, quint8 cmdSet, quint8 cmd )
+{
+    writeUint32( buf, len );
+    writeUint32( buf + 4, id );
+    buf[8] = 0; // flags
+    buf[9] = cmdSet;
+    buf[10] = cmd;
+}
+
 static QByteArray writeString( const QByteArray& str )
 {
     QByteArray res(4,0);
@@ -164,8 +190,13 @@ static QByteArray writeString( const QByteArray& str )
 
 
 Debugger::Debugger(QObject *parent) : QObject(parent),d_sock(0),d_status(WaitHandshake),d_modeReq(0),d_mode(FreeRun),
-    d_breakMeth(0),d_domain(0),d_lineStep(true)
+    d_breakMeth(0),d_domain(0),d_lineStep(true),d_id(0),d_nextId(1),d_waiting(0),
+    d_rd(0),d_rel(0),d_wr(0),d_readAt(0),d_views(0),d_log(0),d_logTime(0),d_traceBufferSize(s_traceBufferSize),d_traceDropped(0),d_epoch(0),d_cacheEpoch(0),d_features(0),d_probed(0)
 {
+    d_clock.start();
+    d_ring = QByteArray( s_ringSize, 0 );
+    d_slots.resize( s_slotCount );
+    d_strings.setMaxCost( s_stringCacheSize );
     d_srv = new QTcpServer(this);
     d_srv->setMaxPendingConnections(1);
     connect( d_srv, SIGNAL(newConnection()), this, SLOT(onNewConnection()) );
@@ -239,33 +270,30 @@ bool Debugger::step(quint32 threadId, Debugger::RunMode mode, bool lineStep)
     // else
     if( !clearStep() )
         return false;
-    QByteArray data(3 + 1 + 16,0);
-    char* d = data.data();
-    d[0] = DebuggerEvent::STEP;
-    d[1] = SUSPEND_POLICY_ALL;
-    d[2] = 1;
-    d[3] = MOD_KIND_STEP;
-    writeUint32(d+4,threadId);
-    writeUint32(d+8, lineStep ? STEP_SIZE_LINE : STEP_SIZE_MIN );
+    Codec::EventSet req(DebuggerEvent::STEP, SUSPEND_POLICY_ALL);
+    req.modifier = MOD_KIND_STEP;
+    req.id = threadId;
+    req.size = lineStep ? STEP_SIZE_LINE : STEP_SIZE_MIN;
     switch( mode )
     {
     case StepIn:
-        writeUint32(d+12,STEP_DEPTH_INTO);
+        req.depth = STEP_DEPTH_INTO;
         break;
     case StepOut:
-        writeUint32(d+12,STEP_DEPTH_OUT);
+        req.depth = STEP_DEPTH_OUT;
         break;
     case StepOver:
-        writeUint32(d+12,STEP_DEPTH_OVER);
+        req.depth = STEP_DEPTH_OVER;
         break;
     }
-    writeUint32(d+16,0); // TODO Filter
-    Reply r = sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_SET, data);
-    if( r.isOk() )
+    // TODO Filter
+    Codec::U32 id;
+    if( call<Codec::EventRequestSet>(req, id) )
     {
         d_mode = mode;
         d_lineStep = lineStep;
-        d_modeReq = readUint32(r.d_data);
+        d_modeReq = id.value;
+        d_requests.insert(d_modeReq, EventRequest(d_modeReq, DebuggerEvent::STEP));
         return sendReceive(CMD_SET_VM,CMD_VM_RESUME).isOk();
     }
     return false;
@@ -275,11 +303,10 @@ bool Debugger::clearStep()
 {
     if( d_mode == FreeRun )
         return true;
-    QByteArray code(5,0);
-    code[0] = DebuggerEvent::STEP;
-    writeUint32(code.data()+1, d_modeReq);
-    if( !sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_CLEAR,code).isOk() )
+    Codec::Empty none;
+    if( !call<Codec::EventRequestClear>(Codec::EventClear(DebuggerEvent::STEP, d_modeReq), none) )
         return false;
+    d_requests.remove(d_modeReq);
     d_modeReq = 0;
     d_mode = FreeRun;
     return true;
@@ -300,21 +327,20 @@ void Debugger::enableExceptionBreaks()
         qCritical() << "cannot retreive System.Exception";
         return;
     }
-    QByteArray event(11,0);
-    event[0] = DebuggerEvent::EXCEPTION;
-    event[1] = SUSPEND_POLICY_ALL;
-    event[2] = 1;
-    event[3] = MOD_KIND_EXCEPTION_ONLY;
-    writeUint32(event.data()+4, type);
-    event[8] = 1; // caught
-    event[9] = 0; // uncaught
+    Codec::EventSet req(DebuggerEvent::EXCEPTION, SUSPEND_POLICY_ALL);
+    req.modifier = MOD_KIND_EXCEPTION_ONLY;
+    req.id = type;
+    req.caught = true;
+    req.uncaught = false;
     // uncaught doesn't seem to work; also others noticed:
     //  https://github.com/mono/mono/issues/15203 and https://github.com/mono/mono/pull/15234
     // there fore added a top-level handler to Main# and look at each exception
-    event[10] = 1; // subclasses
-    Reply r = sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_SET, event);
-    if( !r.isOk() )
+    req.subclasses = true;
+    Codec::U32 id;
+    if( !call<Codec::EventRequestSet>(req, id) )
         qCritical() << "cannot enable exception breaks";
+    else
+        d_requests.insert(id.value, EventRequest(id.value, DebuggerEvent::EXCEPTION));
 #endif
 }
 
@@ -340,13 +366,11 @@ bool Debugger::enableUserBreak()
 
     // enables user breaks which are triggered by calling [mscorlib]System.Diagnostics.Debugger::Break() in the code
     // if not enabled nothing happens
-    QByteArray data(3,0);
-    char* d = data.data();
-    d[0] = DebuggerEvent::USER_BREAK;
-    d[1] = SUSPEND_POLICY_ALL;
-    d[2] = 0;
-    Reply r = sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_SET, data);
-    return r.isOk();
+    Codec::U32 id;
+    if( !call<Codec::EventRequestSet>(Codec::EventSet(DebuggerEvent::USER_BREAK, SUSPEND_POLICY_ALL), id) )
+        return false;
+    d_requests.insert(id.value, EventRequest(id.value, DebuggerEvent::USER_BREAK));
+    return true;
 }
 
 bool Debugger::callUserBreak(quint32 threadId)
@@ -373,21 +397,16 @@ bool Debugger::addBreakpoint(quint32 methodId, quint32 iloffset)
     const QPair<quint32,quint32> key = qMakePair(methodId,iloffset);
     if( d_breakPoints.contains(key) )
         return true;
-    QByteArray data(3 + 1 + 12,0);
-    char* d = data.data();
-    d[0] = DebuggerEvent::BREAKPOINT;
-    d[1] = SUSPEND_POLICY_ALL;
-    d[2] = 1;
-    d[3] = MOD_KIND_LOCATION_ONLY;
-    writeUint32(d+4,methodId);
-    writeUint64(d+8, iloffset );
-    Reply r = sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_SET, data);
-    if( r.isOk() )
-    {
-        d_breakPoints.insert(key,readUint32(r.d_data));
-        return true;
-    }
-    return false;
+    Codec::EventSet req(DebuggerEvent::BREAKPOINT, SUSPEND_POLICY_ALL);
+    req.modifier = MOD_KIND_LOCATION_ONLY;
+    req.id = methodId;
+    req.offset = iloffset;
+    Codec::U32 id;
+    if( !call<Codec::EventRequestSet>(req, id) )
+        return false;
+    d_breakPoints.insert(key,id.value);
+    d_requests.insert(id.value, EventRequest(id.value, DebuggerEvent::BREAKPOINT, methodId, iloffset));
+    return true;
 }
 
 bool Debugger::removeBreakpoint(quint32 methodId, quint32 iloffset)
@@ -399,1142 +418,2826 @@ bool Debugger::removeBreakpoint(quint32 methodId, quint32 iloffset)
     if( !d_breakPoints.contains(key) )
         return true;
 
-    QByteArray code(5,0);
-    code[0] = DebuggerEvent::BREAKPOINT;
-    writeUint32(code.data()+1, d_breakPoints.value(key));
-    if( !sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_CLEAR,code).isOk() )
+    const quint32 id = d_breakPoints.value(key);
+    Codec::Empty none;
+    if( !call<Codec::EventRequestClear>(Codec::EventClear(DebuggerEvent::BREAKPOINT, id), none) )
         return false;
 
     d_breakPoints.remove(key);
+    d_requests.remove(id);
     return true;
 }
 
 bool Debugger::clearAllBreakpoints()
 {
     Reply r = sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_CLEAR_ALL_BREAKPOINTS);
+    if( r.isOk() )
+    {
+        QHash<QPair<quint32,quint32>,quint32>::const_iterator i;
+        for( i = d_breakPoints.begin(); i != d_breakPoints.end(); ++i )
+            d_requests.remove(i.value());
+        d_breakPoints.clear();
+        QHash<quint32,Tracepoint>::const_iterator j;
+        for( j = d_tracepoints.begin(); j != d_tracepoints.end(); ++j )
+            d_requests.remove(j.key());
+        d_tracepoints.clear();
+    }
     return r.isOk();
 }
 
-QList<quint32> Debugger::allThreads()
+quint32 Debugger::addTracepoint(quint32 methodId, quint32 iloffset, const Tracepoint& tp)
 {
-    QList<quint32> res;
     if( !isOpen() )
-        return res;
-    Reply r = sendReceive(CMD_SET_VM,CMD_VM_ALL_THREADS);
-    if( r.isOk() )
+        return 0;
+
+    // without values to capture the VM doesn't have to stop at all; Mono suspends all threads for any
+    // other policy, so the hits are resumed with CMD_VM_RESUME after the values are captured
+    const bool capture = !tp.params.isEmpty() || !tp.locals.isEmpty() || !tp.fields.isEmpty();
+    Codec::EventSet req(DebuggerEvent::BREAKPOINT, capture ? SUSPEND_POLICY_ALL : SUSPEND_POLICY_NONE);
+    req.modifier = MOD_KIND_LOCATION_ONLY;
+    req.id = methodId;
+    req.offset = iloffset;
+    Codec::U32 id;
+    if( !call<Codec::EventRequestSet>(req, id) )
+        return 0;
+    d_requests.insert(id.value, EventRequest(id.value, DebuggerEvent::BREAKPOINT, methodId, iloffset));
+    d_tracepoints.insert(id.value, tp);
+    return id.value;
+}
+
+bool Debugger::removeTracepoint(quint32 requestId)
+{
+    if( !isOpen() )
+        return false;
+    if( !d_tracepoints.contains(requestId) )
+        return true;
+
+    Codec::Empty none;
+    if( !call<Codec::EventRequestClear>(Codec::EventClear(DebuggerEvent::BREAKPOINT, requestId), none) )
+        return false;
+    d_tracepoints.remove(requestId);
+    d_requests.remove(requestId);
+    return true;
+}
+
+QList<Debugger::TraceRecord> Debugger::takeTraceRecords()
+{
+    QList<TraceRecord> res;
+    res.swap(d_traceRecords);
+    return res;
+}
+
+void Debugger::setTraceBufferSize(int records)
+{
+    d_traceBufferSize = qMax( 1, records );
+    while( d_traceRecords.size() > d_traceBufferSize )
+    {
+        d_traceRecords.removeFirst();
+        d_traceDropped++;
+    }
+}
+
+static QByteArray traceText( const QVariant& v )
+{
+    if( v.canConvert<ObjectRef>() )
+        return "#" + QByteArray::number(v.value<ObjectRef>().id);
+    else if( v.canConvert<ValueType>() )
+        return "{" + QByteArray::number(v.value<ValueType>().fields.size()) + " fields}";
+    else if( v.canConvert<UnmanagedPtr>() )
+        return "0x" + QByteArray::number(v.value<UnmanagedPtr>().ptr, 16);
+    else if( v.isNull() )
+        return "null";
+    else
+        return v.toString().toUtf8();
+}
+
+bool Debugger::captureTrace(const DebuggerEvent& e, const Tracepoint& tp)
+{
+    TraceRecord rec;
+    rec.time = d_clock.nsecsElapsed() / 1000;
+    rec.request = e.request;
+    rec.thread = e.thread;
+    rec.hit = d_requests.value(e.request).hits;
+
+    bool ok = true;
+    const int n = tp.params.size() + tp.locals.size();
+    if( n != 0 || !tp.fields.isEmpty() )
     {
-        const char* data = r.d_data.constData();
-        const int count = readUint32(r.d_data.constData());
-        data += 4;
-        for( int i = 0; i < count; i++ )
+        const QList<Frame> top = getStack(e.thread, 0, 1);
+        ok = !top.isEmpty();
+        ValueBuffer vals;
+        if( ok )
         {
-            res << readUint32( data );
-            data += 4;
+            // params and locals with one request, this in parallel if fields of it are captured
+            Codec::FrameValues req(e.thread, top.first().id);
+            for( int i = 0; i < tp.params.size(); i++ )
+                req.positions << -tp.params[i]-1;
+            for( int i = 0; i < tp.locals.size(); i++ )
+                req.positions << tp.locals[i];
+            const quint32 valReq = n != 0 ?
+                        post(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_VALUES, Codec::payload(req)) : 0;
+            const quint32 thisReq = !tp.fields.isEmpty() ? post(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_THIS,
+                                            Codec::payload(Codec::FrameId(e.thread, top.first().id))) : 0;
+            const Reply rVals = take(valReq);
+            const Reply rThis = take(thisReq);
+            if( n != 0 )
+                ok = rVals.isOk() && vals.read(rVals.d_data, 0, n) >= 0;
+            if( ok && !tp.fields.isEmpty() )
+            {
+                ValueBuffer self;
+                ok = rThis.isOk() && self.read(rThis.d_data, 0, 1) >= 0 && self.value(0).kind == ValueBuffer::Ref &&
+                        getValues(self.value(0).id, tp.fields, vals);
+            }
         }
+        rec.values = vals.toVariantList();
     }
-    return res;
+
+    // %1 is the first value; values not captured are shown as ?
+    const QByteArray& m = tp.message;
+    rec.message.reserve(m.size());
+    for( int i = 0; i < m.size(); i++ )
+    {
+        if( m[i] == '%' && i + 1 < m.size() && m[i+1] >= '1' && m[i+1] <= '9' )
+        {
+            int j = i + 1;
+            int index = 0;
+            while( j < m.size() && m[j] >= '0' && m[j] <= '9' )
+                index = index * 10 + ( m[j++] - '0' );
+            if( index <= rec.values.size() )
+                rec.message += traceText(rec.values[index-1]);
+            else
+                rec.message += '?';
+            i = j - 1;
+        }else
+            rec.message += m[i];
+    }
+
+    d_traceRecords.append(rec);
+    if( d_traceRecords.size() > d_traceBufferSize )
+    {
+        d_traceRecords.removeFirst();
+        d_traceDropped++;
+    }
+    return ok;
+}
+
+QList<quint32> Debugger::allThreads()
+{
+    Codec::IdList res;
+    if( !isOpen() )
+        return res.ids;
+    call<Codec::VmAllThreads>(Codec::None(), res);
+    return res.ids;
 }
 
 QByteArray Debugger::getThreadName(quint32 threadId)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),threadId);
-    Reply r = sendReceive(CMD_SET_THREAD, CMD_THREAD_GET_NAME,data);
-    if( r.isOk() )
-        return readString(r.d_data.constData());
-    else
-        return QByteArray();
+    Codec::String res;
+    call<Codec::ThreadGetName>(threadId, res);
+    return res.value;
 }
 
 const char* Debugger::s_state[] = {
     "invalid", "unstarted", "running", "suspended", "aborted", "stopped"
 };
 
+static Debugger::ThreadState toThreadState( quint32 state )
+{
+    if( state & ThreadState_Unstarted )
+        return Debugger::Unstarted;
+    if( state & ThreadState_Aborted )
+        return Debugger::Aborted;
+    if( state & ThreadState_Stopped )
+        return Debugger::Stopped;
+    if( state & ThreadState_Suspended )
+        return Debugger::Suspended;
+    return Debugger::Running;
+}
+
 Debugger::ThreadState Debugger::getThreadState(quint32 threadId)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),threadId);
-    Reply r = sendReceive(CMD_SET_THREAD, CMD_THREAD_GET_STATE,data);
-    if( r.isOk() )
-    {
-        const quint32 state = readUint32(r.d_data.constData());
-        if( state & ThreadState_Unstarted )
-            return Unstarted;
-        if( state & ThreadState_Aborted )
-            return Aborted;
-        if( state & ThreadState_Stopped )
-            return Stopped;
-        if( state & ThreadState_Suspended )
-            return Suspended;
-        return Running;
-    }else
+    Codec::U32 state;
+    if( call<Codec::ThreadGetState>(threadId, state) )
+        return toThreadState(state.value);
+    else
         return Invalid;
 }
 
 quint32 Debugger::getCoreLib(quint32 domainId)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),domainId);
-    Reply r = sendReceive(CMD_SET_APPDOMAIN, CMD_APPDOMAIN_GET_CORLIB,data);
-    if( r.isOk() )
-        return readUint32(r.d_data.constData());
-    return 0;
+    Codec::U32 res;
+    call<Codec::AppDomainGetCorlib>(domainId, res);
+    return res.value;
 }
 
 QList<quint32> Debugger::findType(const QByteArray& name)
 {
-    QByteArray data = writeString(name);
-    data += '\0';
-    Reply r = sendReceive(CMD_SET_VM, CMD_VM_GET_TYPES,data);
-    QList<quint32> res;
-    if( r.isOk() )
-    {
-        int off = 0;
-        quint32 len;
-        off += readUint32(r.d_data,off,len);
-        for( int i = 0; i < len; i++ )
-        {
-            quint32 t;
-            off += readUint32(r.d_data,off,t);
-            res << t;
-        }
-    }
-    return res;
+    Codec::IdList res;
+    call<Codec::VmGetTypes>(name, res);
+    return res.ids;
 }
 
 quint32 Debugger::findType(const QByteArray& name, quint32 assemblyId)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),assemblyId);
-    data += writeString(name);
-    data += '\0';
-    Reply r = sendReceive(CMD_SET_ASSEMBLY, CMD_ASSEMBLY_GET_TYPE,data);
-    if( r.isOk() )
-        return readUint32(r.d_data.constData());
-    else
-        return 0;
+    Codec::U32 res;
+    call<Codec::AssemblyGetType>(Codec::IdName(assemblyId, name), res);
+    return res.value;
 }
 
 QList<quint32> Debugger::getTypesOf(const QString& sourcePath)
 {
-    QByteArray data = writeString(sourcePath.toUtf8());
-    data += '\0';
-    Reply r = sendReceive(CMD_SET_VM, CMD_VM_GET_TYPES_FOR_SOURCE_FILE,data);
-    QList<quint32> res;
-    if( r.isOk() )
-    {
-        int off = 0;
-        quint32 len;
-        off += readUint32(r.d_data,off,len);
-        for( int i = 0; i < len; i++ )
-        {
-            quint32 t;
-            off += readUint32(r.d_data,off,t);
-            res << t;
-        }
-    }
-    return res;
+    Codec::IdList res;
+    call<Codec::VmGetTypesForSourceFile>(sourcePath.toUtf8(), res);
+    return res.ids;
 }
 
-QList<Debugger::Frame> Debugger::getStack(quint32 threadId)
+QList<Debugger::Frame> Debugger::getStack(quint32 threadId, quint32 start, qint32 len)
 {
     QList<Frame> res;
     if( !isOpen() )
         return res;
-    QByteArray payload(12,0);
-    writeUint32(payload.data(), threadId);
-    writeUint32(payload.data()+4, 0);
-    writeUint32(payload.data()+8, -1); // len is not implemented in Mono 3, expects -1
-
-    Reply r = sendReceive(CMD_SET_THREAD,CMD_THREAD_GET_FRAME_INFO,payload);
-    if( r.isOk() )
+    const bool partial = start != 0 || len >= 0;
+    // ranges are not implemented in Mono 3 which expects 0 and -1; tried once with the first partial request
+    const bool ranged = partial && ( hasFeature(FrameRange) || !( d_probed & FrameRange ) );
+    const Reply r = epochCall<Codec::ThreadGetFrameInfo>(
+                Codec::FrameRange(threadId, ranged ? start : 0, ranged ? len : -1));
+    if( ranged && !( d_probed & FrameRange ) && r.d_valid )
     {
-        const char* data = r.d_data.constData();
-        const int count = readUint32(r.d_data.constData());
-        data += 4;
-        for( int i = 0; i < count; i++ )
-        {
-            Frame f;
-            f.id = readUint32( data );
-            data += 4;
-            f.method = readUint32( data );
-            data += 4;
-            f.il_offset = readUint32( data );
-            data += 4;
-            f.flags = *data;
-            data += 1;
-            res << f;
-       }
+        d_probed |= FrameRange;
+        if( r.isOk() )
+            d_features |= FrameRange;
     }
-
+    if( ranged && ( d_probed & FrameRange ) && !hasFeature(FrameRange) )
+        return getStack(threadId, start, len); // not supported; fetch all and take the range
+    Codec::Frames frames;
+    if( decode<Codec::ThreadGetFrameInfo>(r, frames) )
+        res = frames.frames;
+    if( partial && !ranged )
+        return res.mid(start, len);
     return res;
 }
 
-static int readValue( const QByteArray& data, int start, QVariant& val )
+QList<Debugger::ThreadInfo> Debugger::getThreadSnapshot(int topFrames)
 {
-    Q_ASSERT( !data.isEmpty() );
-    quint32 i;
-    quint64 l;
-    quint8 type = (quint8)data[start];
-    const char* d = data.constData()+start+1;
-    switch( type )
+    QList<ThreadInfo> res;
+    const QList<quint32> threads = allThreads();
+    if( threads.isEmpty() )
+        return res;
+    if( topFrames > 0 && !( d_probed & FrameRange ) )
+        getStack(threads.first(), 0, topFrames); // find out whether the agent supports frame ranges
+
+    // name, state, info, tid and the frames of all threads with one batch
+    QList<QByteArray> framePayloads;
+    QList<Reply> frames;
+    Batch b;
+    for( int i = 0; i < threads.size(); i++ )
     {
-    case VT_Void:
-        val = QVariant();
-        return 1;
-    case VT_Boolean:
-        val = readUint32(d) != 0;
-        return 5;
-    case VT_Char:
-        val = QChar(readUint32(d));
-        return 5;
-    case VT_I1:
-        val = QVariant::fromValue(qint8(int(readUint32(d))));
-        return 5;
-    case VT_U1:
-        val = QVariant::fromValue(quint8(readUint32(d)));
-        return 5;
-    case VT_I2:
-        val = QVariant::fromValue(qint16(int(readUint32(d))));
-        return 5;
-    case VT_U2:
-        val = QVariant::fromValue(quint16(readUint32(d)));
-        return 5;
-    case VT_I4:
-        val = int(readUint32(d));
-        return 5;
-    case VT_U4:
-        val = readUint32(d);
-        return 5;
-    case VT_I8:
-        val = qint64(readUint64(d));
-        return 9;
-    case VT_U8:
-        val = readUint64(d);
-        return 9;
-    case VT_R4:
-        i = readUint32(d);
-        val = QVariant::fromValue(*((float*)&i));
-        return 5;
-    case VT_R8:
-        l = readUint64(d);
-        val = *((double*)&l);
-        return 9;
-    case VT_Ptr:
-        val = QVariant::fromValue(UnmanagedPtr(readUint64(d)));
-        return 9;
-    case VT_U:
-        val = readUint64(d);
-        return 9;
-    case VT_I:
-        val = qint64(readUint64(d));
-        return 9;
-    case VT_String:
-        val = QVariant::fromValue(ObjectRef(ObjectRef::String,readUint32(d)));
-        return 5;
-    case VT_Class:
-        val = QVariant::fromValue(ObjectRef(ObjectRef::Class,readUint32(d)));
-        return 5;
-    case VT_Array:
-        val = QVariant::fromValue(ObjectRef(ObjectRef::Array,readUint32(d)));
-        return 5;
-    case VT_Object:
-        val = QVariant::fromValue(ObjectRef(ObjectRef::Object,readUint32(d)));
-        return 5;
-    case VT_SzArray:
-        val = QVariant::fromValue(ObjectRef(ObjectRef::SzArray,readUint32(d)));
-        return 5;
-    case VALUE_TYPE_ID_NULL:
-        val = QVariant();
-        return 1;
-    case VALUE_TYPE_ID_TYPE:
-        val = QVariant::fromValue(ObjectRef(ObjectRef::Type,readUint32(d)));
-        return 5;
-    case VALUE_TYPE_ID_PARENT_VTYPE:
-        val = readUint32(d);
-        return 5;
-    case VT_ValueType:
+        QByteArray data(4,0);
+        writeUint32(data.data(),threads[i]);
+        b.add(CMD_SET_THREAD, CMD_THREAD_GET_NAME, data);
+        b.add(CMD_SET_THREAD, CMD_THREAD_GET_STATE, data);
+        b.add(CMD_SET_THREAD, CMD_THREAD_GET_INFO, data);
+        b.add(CMD_SET_THREAD, CMD_THREAD_GET_TID, data);
+        if( topFrames > 0 )
         {
-            int off = start + 1; // type 1 byte already read
-            const bool isEnum = data[off++] != 0;
-            ValueType vt;
-            off += readUint32(data,off,vt.cls);
-            quint32 len;
-            off += readUint32(data,off,len);
-            if( len > 100 )
-            {
-                // TODO: happens with isEnum=true, to fix
-                return off - start;
-            }
-            for(int j = 0; j < len; j++ )
+            const QByteArray payload = Codec::payload(
+                        Codec::FrameRange(threads[i], 0, hasFeature(FrameRange) ? topFrames : -1));
+            Reply r;
+            if( !fromEpochCache(EpochKey( ( CMD_SET_THREAD << 8 ) | CMD_THREAD_GET_FRAME_INFO, payload ), r) )
+                b.add(CMD_SET_THREAD, CMD_THREAD_GET_FRAME_INFO, payload);
+            framePayloads << payload;
+            frames << r;
+        }
+    }
+    const QList<Reply> replies = execute(b);
+    int j = 0;
+    for( int i = 0; i < threads.size(); i++ )
+    {
+        ThreadInfo t;
+        t.id = threads[i];
+        if( j + 4 > replies.size() )
+            break;
+        const Reply& name = replies[j++];
+        const Reply& state = replies[j++];
+        const Reply& info = replies[j++];
+        const Reply& tid = replies[j++];
+        if( name.isOk() )
+            t.name = readString(name.d_data.constData());
+        if( state.isOk() )
+            t.state = toThreadState(readUint32(state.d_data.constData()));
+        if( info.isOk() && !info.d_data.isEmpty() )
+            t.threadPool = info.d_data[0] != 0;
+        if( tid.isOk() && tid.d_data.size() >= 8 )
+            t.tid = readUint64(tid.d_data.constData());
+        if( topFrames > 0 )
+        {
+            if( !frames[i].d_valid && j < replies.size() )
             {
-                QVariant val2;
-                off += readValue(data,off, val2);
-                vt.fields.append(val2);
+                frames[i] = replies[j++];
+                toEpochCache(EpochKey( ( CMD_SET_THREAD << 8 ) | CMD_THREAD_GET_FRAME_INFO, framePayloads[i] ),
+                             frames[i]);
             }
-            val = QVariant::fromValue(vt);
-            return off - start;
+            Codec::Frames top;
+            if( decode<Codec::ThreadGetFrameInfo>(frames[i], top) )
+                t.top = top.frames;
+            if( t.top.size() > topFrames )
+                t.top = t.top.mid(0, topFrames);
         }
-        break;
-    case VT_ByRef:
-    case VT_Var:
-    case VT_GenericInst:
-    case VT_TypedByRef:
-    case VT_FnPtr:
-    case VT_MVar:
-    case VT_CModReqD:
-    case VT_CModOpt:
-    case VT_Internal:
-    case VT_Modifier:
-    case VT_Sentinel:
-    case VT_Pinned:
-    case VT_Type:
-    case VT_Boxed:
-    case VT_Enum:
-        qWarning() << "readValue: unsupported type" << type;
-        break;
+        res << t;
     }
-    return 0;
+    return res;
 }
 
-QVariantList Debugger::getParamValues(quint32 threadId, quint32 frameId, bool hasThis, quint16 numOfParams)
+QList<Debugger::SymbolFrame> Debugger::getSymbolicatedStack(quint32 threadId)
 {
-    QByteArray payload(8,0);
-    writeUint32(payload.data(), threadId);
-    writeUint32(payload.data()+4, frameId);
-    QVariantList res;
-    if( hasThis )
+    QList<SymbolFrame> res;
+    const QList<Frame> stack = getStack(threadId);
+    QList<quint32> methods;
+    QSet<quint32> seen;
+    for( int i = 0; i < stack.size(); i++ )
     {
-        Reply r = sendReceive(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_THIS,payload);
-        if( !r.isOk() )
-            return res;
-        if( quint8(r.d_data[0]) != VALUE_TYPE_ID_NULL )
+        if( !seen.contains(stack[i].method) )
         {
-            QVariant val;
-            readValue(r.d_data,0,val);
-            res.append(val);
+            seen.insert(stack[i].method);
+            methods << stack[i].method;
         }
     }
-    if( numOfParams == 0 )
-        return res;
-    QByteArray data(4 + numOfParams * 4, 0 );
-    writeUint32(data.data(), numOfParams);
-    int off = 4;
-    for( int i = 0; i < numOfParams; i++ )
+
+    // what is not yet cached is fetched in at most three rounds of pipelined requests
+    Batch b;
+    QList<MetaKey> keys;
+    addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_DECLARING_TYPE, methods);
+    if( d_cacheDir.isEmpty() )
     {
-        writeUint32(data.data() + off, -i-1);
-        off += 4;
-    }
-    Reply r = sendReceive(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_VALUES,payload+data);
-    if( !r.isOk() )
-        return res;
-    off = 0;
-    for( int i = 0; i < numOfParams; i++ )
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_NAME, methods);
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_DEBUG_INFO, methods);
+    }else
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_INFO, methods); // the tokens
+    executeMetadata(b, keys);
+
+    QList<quint32> types;
+    seen.clear();
+    for( int i = 0; i < methods.size(); i++ )
     {
-        QVariant val;
-        off += readValue(r.d_data,off,val);
-        res.append(val);
+        const quint32 type = d_methodType.value(methods[i]);
+        if( type && !seen.contains(type) )
+        {
+            seen.insert(type);
+            types << type;
+        }
     }
-    return res;
-}
+    addMetadataRequests(b, keys, CMD_SET_TYPE, CMD_TYPE_GET_INFO, types);
+    executeMetadata(b, keys);
 
-QVariantList Debugger::getLocalValues(quint32 threadId, quint32 frameId, quint16 numOfLocals)
-{
-    QByteArray payload(8,0);
-    writeUint32(payload.data(), threadId);
-    writeUint32(payload.data()+4, frameId);
-    QVariantList res;
-    if( numOfLocals == 0 )
-        return res;
-    QByteArray data(4 + numOfLocals * 4, 0 );
-    writeUint32(data.data(), numOfLocals);
-    int off = 4;
-    for( int i = 0; i < numOfLocals; i++ )
+    if( !d_cacheDir.isEmpty() )
     {
-        writeUint32(data.data() + off, i);
-        off += 4;
+        // names and debug info come from the disk cache if the stores of the assemblies have them
+        for( int i = 0; i < types.size(); i++ )
+        {
+            const quint32 assembly = d_typeAssembly.value(types[i]);
+            if( assembly )
+                getStore(assembly);
+        }
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_NAME, methods);
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_DEBUG_INFO, methods);
+        executeMetadata(b, keys);
     }
-    Reply r = sendReceive(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_VALUES,payload+data);
-    if( !r.isOk() )
-        return res;
-    off = 0;
-    //qDebug() << "payload" << r.d_data.toHex().constData(); // TEST
-    for( int i = 0; i < numOfLocals; i++ )
+
+    // everything is cached now; the replies are decoded once per method
+    QHash<quint32,MethodDbgInfo> infos;
+    for( int i = 0; i < methods.size(); i++ )
+        infos.insert( methods[i], getMethodInfo(methods[i]) );
+    for( int i = 0; i < stack.size(); i++ )
     {
-        QVariant val;
-        off += readValue(r.d_data,off,val);
-        res.append(val);
+        SymbolFrame f;
+        f.frame = stack[i];
+        f.name = getMethodName(stack[i].method);
+        const quint32 owner = getMethodOwner(stack[i].method);
+        if( owner )
+            f.type = getTypeInfo(owner);
+        else
+            f.type.id = f.type.assembly = f.type.module = 0;
+        const MethodDbgInfo& info = infos[stack[i].method];
+        f.sourceFile = info.sourceFile;
+        f.loc = info.find(stack[i].il_offset);
+        res << f;
     }
     return res;
 }
 
-QString Debugger::getString(quint32 strId)
-{
-    QByteArray data(4,0);
-    writeUint32(data.data(),strId);
-    Reply r = sendReceive(CMD_SET_STRING_REF, CMD_STRING_REF_GET_VALUE,data);
-    if( r.isOk() )
-        return QString::fromUtf8( readString(r.d_data.constData() ) );
-    return QString();
-}
-
-quint32 Debugger::getArrayLength(quint32 arrId)
+double ValueBuffer::Slot::toReal() const
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),arrId);
-    Reply r = sendReceive(CMD_SET_ARRAY_REF, CMD_ARRAY_REF_GET_LENGTH,data);
-    if( r.isOk() )
-        return readUint32(r.d_data.constData()+4); // just interested in the fisrt dim length
-    return 0;
+    if( kind == R4 )
+    {
+        const quint32 i = bits;
+        float f;
+        ::memcpy( &f, &i, 4 );
+        return f;
+    }else if( kind == R8 )
+    {
+        double d;
+        ::memcpy( &d, &bits, 8 );
+        return d;
+    }else
+        return toInt();
 }
 
-QVariantList Debugger::getArrayValues(quint32 arrId, quint32 len)
+QVariant ValueBuffer::toVariant(int i) const
 {
-    QByteArray data(12,0);
-    writeUint32(data.data(),arrId);
-    writeUint32(data.data()+4,0); // index
-    writeUint32(data.data()+8,len);
-    Reply r = sendReceive(CMD_SET_ARRAY_REF, CMD_ARRAY_REF_GET_VALUES,data);
-    if( r.isOk() )
-    {
-        quint32 off = 0;
-        QVariantList res;
-        for( int i = 0; i < len; i++ )
-        {
-            QVariant val;
-            off += readValue(r.d_data,off,val);
-            res.append(val);
-        }
-        return res;
-    }
-    return QVariantList();
+    return toVariant(value(i));
 }
 
-Debugger::MethodDbgInfo Debugger::getMethodInfo(quint32 methodId)
+QVariantList ValueBuffer::toVariantList() const
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_DEBUG_INFO,data);
-    MethodDbgInfo res;
-    res.codeSize = 0;
-    if( r.isOk() )
-    {
-        int off = 0;
-        off += readUint32(r.d_data,off,res.codeSize);
-        quint32 len;
-        off += readUint32(r.d_data,off,len); // number of source files
-        if( len == 0 )
-            return res;
-
-        for( int i = 0; i < len; i++ )
-        {
-            off += readString(r.d_data,off,res.sourceFile);
-            off += 16; // hash
-        }
-
-        off += readUint32(r.d_data,off,len); // number of il offsets
-        if( len == 0 )
-            return res;
-
-        for( int i = 0; i < len; i++ )
-        {
-            quint32 unused, col;
-            MethodDbgInfo::Loc loc;
-            loc.valid = true;
-            off += readUint32(r.d_data,off,loc.iloff);
-            off += readUint32(r.d_data,off,loc.row);
-            off += readUint32(r.d_data,off,unused); // source
-            off += readUint32(r.d_data,off,col);
-            loc.col = (int)col; // can be negative
-            off += readUint32(r.d_data,off,unused); // end line
-            off += readUint32(r.d_data,off,unused); // end column
-            res.lines.append(loc);
-        }
-    }
+    QVariantList res;
+    for( int i = 0; i < d_roots.size(); i++ )
+        res << toVariant(d_slots[d_roots[i]]);
     return res;
 }
 
-QByteArray Debugger::getMethodName(quint32 methodId)
+int ValueBuffer::memory() const
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_NAME,data);
-    if( r.isOk() )
-        return readString(r.d_data.constData());
-    else
-        return QByteArray();
+    return d_slots.capacity() * sizeof(Slot) + d_roots.capacity() * sizeof(int);
 }
 
-quint32 Debugger::getMethodOwner(quint32 methodId)
+void ValueBuffer::clear()
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_DECLARING_TYPE,data);
-    if( r.isOk() )
-        return readUint32(r.d_data.constData());
-    else
-        return 0;
+    d_slots.clear();
+    d_roots.clear();
 }
 
-QByteArray Debugger::getMethodBody(quint32 methodId)
+QVariant ValueBuffer::toVariant(const Slot& s) const
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_BODY,data);
-    QByteArray res;
-    if( r.isOk() )
+    switch( s.kind )
     {
-        quint32 len = readUint32(r.d_data.constData());
-        if( len )
-            res = r.d_data.mid(4, len);
+    case Bool:
+        return s.bits != 0;
+    case Char:
+        return QChar(quint32(s.bits));
+    case I1:
+        return QVariant::fromValue(qint8(s.bits));
+    case U1:
+        return QVariant::fromValue(quint8(s.bits));
+    case I2:
+        return QVariant::fromValue(qint16(s.bits));
+    case U2:
+        return QVariant::fromValue(quint16(s.bits));
+    case I4:
+        return int(s.bits);
+    case U4:
+    case ParentVType:
+        return quint32(s.bits);
+    case I8:
+    case IntPtr:
+        return qint64(s.bits);
+    case U8:
+    case UIntPtr:
+        return s.bits;
+    case R4:
+        return QVariant::fromValue(float(s.toReal()));
+    case R8:
+        return s.toReal();
+    case Ptr:
+        return QVariant::fromValue(UnmanagedPtr(s.bits));
+    case Ref:
+        return QVariant::fromValue(ObjectRef(s.sub,s.id));
+    case Struct:
+        {
+            ValueType vt;
+            vt.cls = s.id;
+            for( quint32 i = 0; i < s.count(); i++ )
+                vt.fields.append( toVariant(d_slots[s.first() + i]) );
+            return QVariant::fromValue(vt);
+        }
+    default:
+        return QVariant();
     }
-    return res;
 }
 
-QPair<quint32, quint32> Debugger::getMethodFlags(quint32 methodId)
+static ValueBuffer::Slot invalidSlot()
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_INFO,data);
-    if( r.isOk() )
-        return qMakePair(readUint32(r.d_data.constData()), // method flags
-                         readUint32(r.d_data.constData()+4)); // implementation flags
-    return qMakePair(0,0);
+    ValueBuffer::Slot v;
+    v.kind = ValueBuffer::Invalid;
+    v.sub = 0;
+    v.reserved = 0;
+    v.id = 0;
+    v.bits = 0;
+    return v;
 }
 
-bool Debugger::isMethodStatic(quint32 methodId)
+int ValueBuffer::read(const QByteArray& data, int off, int count, int skipped)
 {
-    QPair<quint32, quint32> flags = getMethodFlags(methodId);
-    return flags.first & METHOD_ATTRIBUTE_STATIC;
+    // the values are in d_roots order, the fields of structs are appended behind them
+    const int start = off;
+    const int first = d_slots.size();
+    d_slots.resize( first + count );
+    int fields = d_slots.size(); // the end of the fields of the values read so far
+    bool ok = true;
+    for( int j = 0; ok && j < skipped; j++ )
+    {
+        const int n = skip(data, off);
+        ok = n >= 0;
+        off += n;
+    }
+    int i = 0;
+    for( ; ok && i < count; i++ )
+    {
+        const int n = readSlot(data, off, first + i);
+        if( n < 0 )
+            break;
+        d_roots.append( first + i );
+        off += n;
+        fields = d_slots.size();
+    }
+    if( ok && i == count )
+        return off - start;
+    // the offset of the following values is unknown, so they are Invalid too; the fields of the invalid
+    // value are not kept
+    d_slots.resize( fields );
+    for( ; i < count; i++ )
+    {
+        d_slots[first + i] = invalidSlot();
+        d_roots.append( first + i );
+    }
+    return -1;
 }
 
-Debugger::MethodKind Debugger::getMethodKind(quint32 methodId)
+void ValueBuffer::appendInvalid(int count)
 {
-    QPair<quint32, quint32> flags = getMethodFlags(methodId);
-    switch( flags.second & 3 )
+    for( int i = 0; i < count; i++ )
     {
-    case 0:
-    case 2:
-        return IL;
-    case 1:
-        return Native;
-    case 3:
-        return Runtime;
+        d_roots.append( d_slots.size() );
+        d_slots.append( invalidSlot() );
     }
 }
 
-quint16 Debugger::getParamCount(quint32 methodId)
+int ValueBuffer::readSlot(const QByteArray& data, int off, int s)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_PARAM_INFO,data);
-    if( r.isOk() )
+    Codec::Decoder d(data, off);
+    const quint8 type = d.u8();
+    Slot v;
+    v.kind = Null;
+    v.sub = 0;
+    v.reserved = 0;
+    v.id = 0;
+    v.bits = 0;
+    quint32 i = 0;
+    if( !d.ok() )
+        return -1;
+    switch( type )
+    {
+    case VT_Void:
+    case VALUE_TYPE_ID_NULL:
+        break;
+    case VT_Boolean:
+    case VT_Char:
+    case VT_U1:
+    case VT_U2:
+    case VT_U4:
+    case VALUE_TYPE_ID_PARENT_VTYPE:
+        i = d.u32();
+        v.kind = type == VT_Boolean ? Bool : type == VT_Char ? Char : type == VT_U1 ? U1 : type == VT_U2 ? U2 :
+                 type == VT_U4 ? U4 : ParentVType;
+        v.bits = i;
+        break;
+    case VT_I1:
+    case VT_I2:
+    case VT_I4:
+        i = d.u32();
+        v.kind = type == VT_I1 ? I1 : type == VT_I2 ? I2 : I4;
+        v.bits = qint64(qint32(i));
+        break;
+    case VT_R4:
+        i = d.u32();
+        v.kind = R4;
+        v.bits = i;
+        break;
+    case VT_I8:
+    case VT_U8:
+    case VT_R8:
+    case VT_Ptr:
+    case VT_U:
+    case VT_I:
+        v.bits = d.u64();
+        v.kind = type == VT_I8 ? I8 : type == VT_U8 ? U8 : type == VT_R8 ? R8 : type == VT_Ptr ? Ptr :
+                 type == VT_U ? UIntPtr : IntPtr;
+        break;
+    case VT_String:
+    case VT_Class:
+    case VT_Array:
+    case VT_Object:
+    case VT_SzArray:
+    case VALUE_TYPE_ID_TYPE:
+        v.id = d.u32();
+        v.kind = Ref;
+        v.sub = type == VT_String ? ObjectRef::String : type == VT_Class ? ObjectRef::Class :
+                type == VT_Array ? ObjectRef::Array : type == VT_Object ? ObjectRef::Object :
+                type == VT_SzArray ? ObjectRef::SzArray : ObjectRef::Type;
+        break;
+    case VT_ValueType:
+        {
+            v.kind = Struct;
+            v.sub = d.u8() != 0; // is enum
+            v.id = d.u32();
+            const quint32 count = d.u32();
+            if( !d.need(count) ) // each field takes at least one byte
+                return -1;
+            const int first = d_slots.size();
+            d_slots.resize( first + count );
+            v.bits = ( quint64(count) << 32 ) | first;
+            for( quint32 j = 0; j < count; j++ )
+            {
+                const int n = readSlot(data, d.pos(), first + j);
+                if( n < 0 )
+                    return -1;
+                d.skip(n);
+            }
+        }
+        break;
+    default:
+        qWarning() << "ValueBuffer: unsupported type" << type;
+        return -1;
+    }
+    if( !d.ok() )
+        return -1;
+    d_slots[s] = v;
+    return d.pos() - off;
+}
+
+int ValueBuffer::skip(const QByteArray& data, int off)
+{
+    Codec::Decoder d(data, off);
+    const quint8 type = d.u8();
+    if( !d.ok() )
+        return -1;
+    switch( type )
+    {
+    case VT_Void:
+    case VALUE_TYPE_ID_NULL:
+        break;
+    case VT_I8:
+    case VT_U8:
+    case VT_R8:
+    case VT_Ptr:
+    case VT_U:
+    case VT_I:
+        d.skip(8);
+        break;
+    case VT_ValueType:
+        {
+            d.skip(1 + 4); // is enum, class
+            const quint32 count = d.u32();
+            if( !d.need(count) )
+                return -1;
+            for( quint32 j = 0; j < count; j++ )
+            {
+                const int n = skip(data, d.pos());
+                if( n < 0 )
+                    return -1;
+                d.skip(n);
+            }
+        }
+        break;
+    case VT_Boolean:
+    case VT_Char:
+    case VT_I1:
+    case VT_U1:
+    case VT_I2:
+    case VT_U2:
+    case VT_I4:
+    case VT_U4:
+    case VT_R4:
+    case VT_String:
+    case VT_Class:
+    case VT_Array:
+    case VT_Object:
+    case VT_SzArray:
+    case VALUE_TYPE_ID_TYPE:
+    case VALUE_TYPE_ID_PARENT_VTYPE:
+        d.skip(4);
+        break;
+    default:
+        return -1;
+    }
+    return d.ok() ? d.pos() - off : -1;
+}
+
+QVariantList Debugger::getParamValues(quint32 threadId, quint32 frameId, bool hasThis, quint16 numOfParams)
+{
+    QVariantList res;
+    Codec::FrameValues vals(threadId, frameId);
+    for( int i = 0; i < numOfParams; i++ )
+        vals.positions << -i-1;
+    const EpochKey thisKey( ( CMD_SET_STACK_FRAME << 8 ) | CMD_STACK_FRAME_GET_THIS,
+                            Codec::payload(Codec::FrameId(threadId, frameId)) );
+    const EpochKey valKey( ( CMD_SET_STACK_FRAME << 8 ) | CMD_STACK_FRAME_GET_VALUES, Codec::payload(vals) );
+    Reply rThis, rVals;
+    // both requests are put on the wire before waiting for the first reply
+    quint32 thisReq = 0, valReq = 0;
+    if( hasThis && !fromEpochCache(thisKey,rThis) )
+        thisReq = post(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_THIS,thisKey.second);
+    if( numOfParams != 0 && !fromEpochCache(valKey,rVals) )
+        valReq = post(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_VALUES,valKey.second);
+    if( thisReq )
+    {
+        rThis = take(thisReq);
+        toEpochCache(thisKey,rThis);
+    }
+    if( valReq )
+    {
+        rVals = take(valReq);
+        toEpochCache(valKey,rVals);
+    }
+    // invalid values are null, like the ones after them
+    ValueBuffer b;
+    if( hasThis )
+    {
+        if( !rThis.isOk() )
+            return res;
+        b.read(rThis.d_data, 0, 1);
+        if( b.value(0).kind != ValueBuffer::Null )
+            res.append(b.toVariant(0));
+        b.clear();
+    }
+    if( numOfParams == 0 || !rVals.isOk() )
+        return res;
+    if( b.read(rVals.d_data, 0, numOfParams) < 0 )
+        qWarning() << "getParamValues: invalid or unsupported value received";
+    res += b.toVariantList();
+    return res;
+}
+
+QVariantList Debugger::getLocalValues(quint32 threadId, quint32 frameId, quint16 numOfLocals)
+{
+    ValueBuffer b;
+    getLocalValues(threadId, frameId, numOfLocals, b);
+    return b.toVariantList();
+}
+
+bool Debugger::getLocalValues(quint32 threadId, quint32 frameId, quint16 numOfLocals, ValueBuffer& res)
+{
+    if( numOfLocals == 0 )
+        return true;
+    Codec::FrameValues vals(threadId, frameId);
+    for( int i = 0; i < numOfLocals; i++ )
+        vals.positions << i;
+    const Reply r = epochCall<Codec::FrameGetValues>(vals);
+    if( !r.isOk() )
+        return false;
+    return res.read(r.d_data, 0, numOfLocals) >= 0;
+}
+
+Debugger::FrameSnapshot Debugger::getFrameSnapshot(quint32 threadId, const Frame& frame)
+{
+    FrameSnapshot res;
+    const quint32 m = frame.method;
+
+    // metadata not yet cached is fetched in one round
+    QList<quint32> ids;
+    ids << m;
+    Batch b;
+    QList<MetaKey> keys;
+    addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_INFO, ids);
+    addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_DECLARING_TYPE, ids);
+    addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_PARAM_INFO, ids);
+    addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_LOCALS_INFO, ids);
+    executeMetadata(b, keys);
+    const QByteArray infoReply = d_meta.value( MetaKey( ( CMD_SET_METHOD << 8 ) | CMD_METHOD_GET_INFO, m ) );
+    Codec::Decoder d(infoReply);
+    Codec::MethodInfo info;
+    info.decode(d);
+    // the param and locals info is from the VM, not from the disk cache, because the type ids are needed
+    const QByteArray paramReply = d_meta.value( MetaKey( ( CMD_SET_METHOD << 8 ) | CMD_METHOD_GET_PARAM_INFO, m ) );
+    const QByteArray localsReply = d_meta.value( MetaKey( ( CMD_SET_METHOD << 8 ) | CMD_METHOD_GET_LOCALS_INFO, m ) );
+    Codec::Decoder pd(paramReply), ld(localsReply);
+    Codec::ParamInfo params;
+    Codec::LocalsInfo locals;
+    params.decode(pd);
+    locals.decode(ld);
+    if( !d.ok() || !pd.ok() || !ld.ok() )
+        return res;
+    const bool isStatic = info.flags & METHOD_ATTRIBUTE_STATIC;
+    for( int i = 0; i < params.types.size(); i++ )
+    {
+        Variable v;
+        v.type = params.types[i];
+        v.name = params.names[i];
+        res.params << v;
+    }
+    for( int i = 0; i < locals.types.size(); i++ )
+    {
+        Variable v;
+        v.type = locals.types[i];
+        v.name = locals.names[i];
+        res.locals << v;
+    }
+
+    // this, params and locals in one round, the latter two with one request
+    const int n = res.params.size() + res.locals.size();
+    Codec::FrameValues vals(threadId, frame.id);
+    for( int i = 0; i < res.params.size(); i++ )
+        vals.positions << -i-1;
+    for( int i = 0; i < res.locals.size(); i++ )
+        vals.positions << i;
+    const EpochKey thisKey( ( CMD_SET_STACK_FRAME << 8 ) | CMD_STACK_FRAME_GET_THIS,
+                            Codec::payload(Codec::FrameId(threadId, frame.id)) );
+    const EpochKey valKey( ( CMD_SET_STACK_FRAME << 8 ) | CMD_STACK_FRAME_GET_VALUES, Codec::payload(vals) );
+    Reply rThis, rVals;
+    quint32 thisReq = 0, valReq = 0;
+    if( !isStatic && !fromEpochCache(thisKey,rThis) )
+        thisReq = post(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_THIS,thisKey.second);
+    if( n != 0 && !fromEpochCache(valKey,rVals) )
+        valReq = post(CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_VALUES,valKey.second);
+    if( thisReq )
+    {
+        rThis = take(thisReq);
+        toEpochCache(thisKey,rThis);
+    }
+    if( valReq )
+    {
+        rVals = take(valReq);
+        toEpochCache(valKey,rVals);
+    }
+    if( !isStatic )
+    {
+        if( !rThis.isOk() )
+            return res;
+        res.self.name = "this";
+        res.self.type = d_methodType.value(m);
+        ValueBuffer b;
+        b.read(rThis.d_data, 0, 1);
+        res.self.value = b.toVariant(0); // null if invalid
+        res.hasThis = true;
+    }
+    // invalid values are null, like the ones after them, and the snapshot is not valid
+    bool ok = true;
+    if( n != 0 )
+    {
+        if( !rVals.isOk() )
+            return res;
+        ValueBuffer b;
+        ok = b.read(rVals.d_data, 0, n) >= 0;
+        for( int i = 0; i < res.params.size(); i++ )
+            res.params[i].value = b.toVariant(i);
+        for( int i = 0; i < res.locals.size(); i++ )
+            res.locals[i].value = b.toVariant(res.params.size() + i);
+    }
+    res.valid = ok;
+    return res;
+}
+
+QString Debugger::getString(quint32 strId)
+{
+    QByteArray data(4,0);
+    writeUint32(data.data(),strId);
+    CachedString* cs = d_strings.object(strId);
+    if( cs && cs->epoch != d_epoch )
+    {
+        // strings are immutable, but the id could have been reused if the string was collected while running
+        Codec::U32 collected;
+        if( call<Codec::ObjectIsCollected>(strId, collected) && collected.value == 0 )
+            cs->epoch = d_epoch;
+        else
+        {
+            d_strings.remove(strId);
+            cs = 0;
+        }
+    }
+    if( cs )
+        return cs->str;
+    Reply r = sendReceive(CMD_SET_STRING_REF, CMD_STRING_REF_GET_VALUE,data);
+    if( !r.isOk() )
+        return QString();
+    cs = new CachedString();
+    cs->str = QString::fromUtf8( readString(r.d_data.constData() ) );
+    cs->epoch = d_epoch;
+    const QString res = cs->str;
+    d_strings.insert( strId, cs, res.size() * 2 + sizeof(CachedString) );
+    return res;
+}
+
+qint64 Debugger::getStringLength(quint32 strId)
+{
+    CachedString* cs = d_strings.object(strId);
+    if( cs && cs->epoch == d_epoch )
+        return cs->str.size();
+    QByteArray data(4,0);
+    writeUint32(data.data(),strId);
+    Reply r = epochReceive(CMD_SET_STRING_REF, CMD_STRING_REF_GET_LENGTH,data);
+    if( r.isOk() && r.d_data.size() >= 8 )
+        return readUint64(r.d_data.constData());
+    return -1;
+}
+
+QString Debugger::getStringChars(quint32 strId, qint64 start, int count)
+{
+    CachedString* cs = d_strings.object(strId);
+    if( cs && cs->epoch == d_epoch )
+        return cs->str.mid(start, count);
+    const qint64 len = getStringLength(strId);
+    if( start < 0 || start >= len || count <= 0 )
+        return QString();
+    count = qMin( qint64(count), len - start );
+    QByteArray data(20,0);
+    writeUint32(data.data(),strId);
+    writeUint64(data.data()+4,start);
+    writeUint64(data.data()+12,count);
+    Reply r = epochReceive(CMD_SET_STRING_REF, CMD_STRING_REF_GET_CHARS,data);
+    if( !r.isOk() || r.d_data.size() < count * 2 )
+        return QString();
+    // UTF-16 code units, big-endian
+    QString res(count, Qt::Uninitialized);
+    QChar* out = res.data();
+    const char* in = r.d_data.constData();
+    for( int i = 0; i < count; i++ )
+        out[i] = QChar( readUint16(in + i * 2) );
+    return res;
+}
+
+QString Debugger::getString(quint32 strId, int maxLen, bool* truncated)
+{
+    const qint64 len = getStringLength(strId);
+    if( truncated )
+        *truncated = len > maxLen;
+    if( len < 0 )
+        return QString();
+    if( len <= maxLen )
+        return getString(strId);
+    QString res = getStringChars(strId, 0, maxLen);
+    if( !res.isEmpty() && res.at(res.size() - 1).isHighSurrogate() )
+        res.chop(1); // don't split a surrogate pair
+    return res;
+}
+
+void Debugger::setStringCacheSize(int bytes)
+{
+    d_strings.setMaxCost(bytes);
+}
+
+quint32 Debugger::getArrayLength(quint32 arrId)
+{
+    const ArrayBounds b = getArrayBounds(arrId);
+    if( b.rank() > 0 )
+        return b.lengths.first();
+    return 0;
+}
+
+quint32 Debugger::ArrayBounds::count() const
+{
+    if( lengths.isEmpty() )
+        return 0;
+    // the agent addresses the elements with int32 indices, so larger arrays cannot be valid
+    quint64 res = 1;
+    for( int i = 0; i < lengths.size(); i++ )
+    {
+        res *= lengths[i];
+        if( res > quint64(std::numeric_limits<qint32>::max()) )
+            return 0;
+    }
+    return res;
+}
+
+qint32 Debugger::ArrayBounds::indexOf(const QList<qint32>& index) const
+{
+    if( index.size() != lengths.size() || count() == 0 )
+        return -1;
+    qint64 res = 0; // below count(), so it fits
+    for( int i = 0; i < index.size(); i++ )
+    {
+        const qint64 j = qint64(index[i]) - lowerBounds[i];
+        if( j < 0 || j >= lengths[i] )
+            return -1;
+        res = res * lengths[i] + j;
+    }
+    return res;
+}
+
+Debugger::ArrayBounds Debugger::getArrayBounds(quint32 arrId)
+{
+    Codec::Bounds res;
+    if( !decode<Codec::ArrayGetLength>(epochCall<Codec::ArrayGetLength>(arrId), res) )
+        return ArrayBounds();
+    return res.bounds;
+}
+
+QVariantList Debugger::getArrayValues(quint32 arrId, quint32 len)
+{
+    return getArrayValues(arrId, 0, len);
+}
+
+bool Debugger::getArrayPages(quint32 arrId, quint32& start, quint32& count, QList<QByteArray>& pages)
+{
+    const quint32 total = getArrayBounds(arrId).count(); // at most INT_MAX, so start + count doesn't wrap
+    if( start >= total || count == 0 )
+        return false;
+    count = qMin( count, total - start );
+
+    // pages are aligned to ArrayPageSize so that overlapping windows share them
+    const quint32 first = start / ArrayPageSize;
+    const quint32 last = ( start + count - 1 ) / ArrayPageSize;
+    QList<EpochKey> keys;
+    QList<int> missing;
+    Batch b;
+    for( quint32 p = first; p <= last; p++ )
+    {
+        const QByteArray data = Codec::payload( Codec::ArrayRange(arrId, p * ArrayPageSize,
+                                                qMin( quint32(ArrayPageSize), total - p * ArrayPageSize )) );
+        const EpochKey key( ( CMD_SET_ARRAY_REF << 8 ) | CMD_ARRAY_REF_GET_VALUES, data );
+        Reply r;
+        if( !fromEpochCache(key,r) )
+        {
+            b.add(CMD_SET_ARRAY_REF, CMD_ARRAY_REF_GET_VALUES, data);
+            missing << pages.size();
+        }
+        pages << r.d_data;
+        keys << key;
+    }
+    if( !b.isEmpty() )
+    {
+        const QList<Reply> r = execute(b);
+        for( int i = 0; i < r.size(); i++ )
+        {
+            if( !r[i].isOk() )
+                return false;
+            toEpochCache(keys[missing[i]],r[i]);
+            pages[missing[i]] = r[i].d_data;
+        }
+    }
+    return true;
+}
+
+QVariantList Debugger::getArrayValues(quint32 arrId, quint32 start, quint32 count)
+{
+    ValueBuffer b;
+    getArrayValues(arrId, start, count, b);
+    return b.toVariantList();
+}
+
+bool Debugger::getArrayValues(quint32 arrId, quint32 start, quint32 count, ValueBuffer& res)
+{
+    QList<QByteArray> pages;
+    if( !getArrayPages(arrId, start, count, pages) )
+        return false;
+    const quint32 first = start / ArrayPageSize;
+    for( int p = 0; p < pages.size(); p++ )
+    {
+        const quint32 pageStart = ( first + p ) * ArrayPageSize;
+        const quint32 from = qMax( start, pageStart ) - pageStart;
+        const quint32 to = qMin( start + count, pageStart + ArrayPageSize ) - pageStart;
+        if( res.read(pages[p], 0, to - from, from) < 0 )
+        {
+            res.appendInvalid( start + count - ( pageStart + to ) ); // the rest of the window
+            return false;
+        }
+    }
+    return true;
+}
+
+template<class T>
+static inline T fromBits( quint64 v )
+{
+    return T(v);
+}
+
+template<>
+inline float fromBits<float>( quint64 v )
+{
+    const quint32 i = v;
+    float f;
+    ::memcpy( &f, &i, 4 );
+    return f;
+}
+
+template<>
+inline double fromBits<double>( quint64 v )
+{
+    double d;
+    ::memcpy( &d, &v, 8 );
+    return d;
+}
+
+// Primitive elements all have the same size on the wire, one tag byte followed by a big-endian int32 or int64,
+// so the element i of a page is at i * ( 1 + Bytes ) and can be decoded without going through ValueBuffer.
+// The sizes and tags of all pages are checked before anything is allocated or converted; the second pass is
+// then a loop without branches over the byte swaps.
+template<class T, int Bytes, class Vector>
+static bool readPrimitives( const QList<QByteArray>& pages, quint32 start, quint32 count,
+                            quint8 tag1, quint8 tag2, Vector& res )
+{
+    const int stride = 1 + Bytes;
+    const quint32 first = start / Debugger::ArrayPageSize;
+    quint32 n = 0;
+    for( int p = 0; p < pages.size(); p++ )
+    {
+        const quint32 pageStart = ( first + p ) * Debugger::ArrayPageSize;
+        const quint32 from = qMax( start, pageStart ) - pageStart;
+        const quint32 to = qMin( start + count, pageStart + Debugger::ArrayPageSize ) - pageStart;
+        if( quint32(pages[p].size()) < to * stride )
+            return false;
+        const char* d = pages[p].constData() + from * stride;
+        for( quint32 i = from; i < to; i++, d += stride )
+        {
+            if( quint8(d[0]) != tag1 && quint8(d[0]) != tag2 )
+                return false;
+        }
+        n += to - from;
+    }
+    if( n != count ) // the pages don't cover the requested elements
+        return false;
+
+    res.resize(count);
+    T* out = reinterpret_cast<T*>( res.data() );
+    for( int p = 0; p < pages.size(); p++ )
+    {
+        const quint32 pageStart = ( first + p ) * Debugger::ArrayPageSize;
+        const quint32 from = qMax( start, pageStart ) - pageStart;
+        const quint32 to = qMin( start + count, pageStart + Debugger::ArrayPageSize ) - pageStart;
+        const char* d = pages[p].constData() + from * stride + 1;
+        for( quint32 i = from; i < to; i++, d += stride )
+        {
+            if( Bytes == 4 )
+                *out++ = fromBits<T>( readUint32(d) );
+            else
+                *out++ = fromBits<T>( readUint64(d) );
+        }
+    }
+    return true;
+}
+
+QVector<qint32> Debugger::getArrayI32(quint32 arrId, quint32 start, quint32 count)
+{
+    QVector<qint32> res;
+    QList<QByteArray> pages;
+    if( !getArrayPages(arrId, start, count, pages) )
+        return res;
+    if( !readPrimitives<qint32,4>(pages, start, count, VT_I4, VT_U4, res) )
+        return QVector<qint32>();
+    return res;
+}
+
+QVector<qint64> Debugger::getArrayI64(quint32 arrId, quint32 start, quint32 count)
+{
+    QVector<qint64> res;
+    QList<QByteArray> pages;
+    if( !getArrayPages(arrId, start, count, pages) )
+        return res;
+    if( !readPrimitives<qint64,8>(pages, start, count, VT_I8, VT_U8, res) )
+        return QVector<qint64>();
+    return res;
+}
+
+QVector<float> Debugger::getArrayR32(quint32 arrId, quint32 start, quint32 count)
+{
+    QVector<float> res;
+    QList<QByteArray> pages;
+    if( !getArrayPages(arrId, start, count, pages) )
+        return res;
+    if( !readPrimitives<float,4>(pages, start, count, VT_R4, VT_R4, res) )
+        return QVector<float>();
+    return res;
+}
+
+QVector<double> Debugger::getArrayR64(quint32 arrId, quint32 start, quint32 count)
+{
+    QVector<double> res;
+    QList<QByteArray> pages;
+    if( !getArrayPages(arrId, start, count, pages) )
+        return res;
+    if( !readPrimitives<double,8>(pages, start, count, VT_R8, VT_R8, res) )
+        return QVector<double>();
+    return res;
+}
+
+QByteArray Debugger::getArrayU8(quint32 arrId, quint32 start, quint32 count)
+{
+    QByteArray res;
+    QList<QByteArray> pages;
+    if( !getArrayPages(arrId, start, count, pages) )
+        return res;
+    if( !readPrimitives<char,4>(pages, start, count, VT_U1, VT_I1, res) )
+        return QByteArray();
+    return res;
+}
+
+Debugger::MethodDbgInfo Debugger::getMethodInfo(quint32 methodId)
+{
+    Codec::DebugInfo res;
+    cachedCall<Codec::MethodGetDebugInfo>(methodId, res);
+    return res.info;
+}
+
+QByteArray Debugger::getMethodName(quint32 methodId)
+{
+    Codec::String res;
+    cachedCall<Codec::MethodGetName>(methodId, res);
+    return res.value;
+}
+
+QByteArrayList Debugger::getMethodNames(const QList<quint32>& methodIds)
+{
+    Batch b;
+    QList<MetaKey> keys;
+    addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_NAME, methodIds);
+    executeMetadata(b, keys);
+    QByteArrayList res;
+    for( int i = 0; i < methodIds.size(); i++ )
+    {
+        // names which could not be fetched are empty
+        const QByteArray reply = d_meta.value( MetaKey( ( CMD_SET_METHOD << 8 ) | CMD_METHOD_GET_NAME, methodIds[i] ) );
+        Codec::Decoder d(reply);
+        Codec::String name;
+        name.decode(d);
+        res << name.value;
+    }
+    return res;
+}
+
+quint32 Debugger::getMethodOwner(quint32 methodId)
+{
+    Codec::U32 res;
+    cachedCall<Codec::MethodGetDeclaringType>(methodId, res);
+    return res.value;
+}
+
+QByteArray Debugger::getMethodBody(quint32 methodId)
+{
+    Codec::String res;
+    cachedCall<Codec::MethodGetBody>(methodId, res);
+    return res.value;
+}
+
+QPair<quint32, quint32> Debugger::getMethodFlags(quint32 methodId)
+{
+    Codec::MethodInfo res;
+    cachedCall<Codec::MethodGetInfo>(methodId, res);
+    return qMakePair(res.flags, res.implFlags);
+}
+
+bool Debugger::isMethodStatic(quint32 methodId)
+{
+    QPair<quint32, quint32> flags = getMethodFlags(methodId);
+    return flags.first & METHOD_ATTRIBUTE_STATIC;
+}
+
+Debugger::MethodKind Debugger::getMethodKind(quint32 methodId)
+{
+    QPair<quint32, quint32> flags = getMethodFlags(methodId);
+    switch( flags.second & 3 )
+    {
+    case 0:
+    case 2:
+        return IL;
+    case 1:
+        return Native;
+    case 3:
+        return Runtime;
+    }
+}
+
+quint16 Debugger::getParamCount(quint32 methodId)
+{
+    Codec::ParamInfo res;
+    cachedCall<Codec::MethodGetParamInfo>(methodId, res);
+    return res.types.size();
+}
+
+QByteArrayList Debugger::getParamNames(quint32 methodId)
+{
+    Codec::ParamInfo res;
+    cachedCall<Codec::MethodGetParamInfo>(methodId, res);
+    return res.names;
+}
+
+quint16 Debugger::getLocalsCount(quint32 methodId)
+{
+    Codec::LocalsInfo res;
+    cachedCall<Codec::MethodGetLocalsInfo>(methodId, res);
+    return res.types.size();
+}
+
+QByteArrayList Debugger::getLocalNames(quint32 methodId)
+{
+    Codec::LocalsInfo res;
+    cachedCall<Codec::MethodGetLocalsInfo>(methodId, res);
+    return res.names;
+}
+
+Debugger::TypeInfo Debugger::getTypeInfo(quint32 typeId)
+{
+    Codec::TypeInfo res;
+    cachedCall<Codec::TypeGetInfo>(typeId, res);
+    return res.info;
+}
+
+quint32 Debugger::getTypeObject(quint32 typeId)
+{
+    Codec::U32 res;
+    call<Codec::TypeGetObject>(typeId, res);
+    return res.value;
+}
+
+QList<quint32> Debugger::getMethods(quint32 typeId, const QByteArray& name)
+{
+    Codec::IdList res;
+    if( !name.isEmpty() )
+    {
+        // the VM filters by name; agents rejecting the command get the list and the names with one batch
+        if( hasFeature(MethodsByNameFlags) || !( d_probed & MethodsByNameFlags ) )
+        {
+            const Reply r = sendReceive(CMD_SET_TYPE, CMD_TYPE_GET_METHODS_BY_NAME_FLAGS,
+                                        Codec::payload(Codec::MethodsByName(typeId, name)));
+            if( !r.d_valid )
+                return QList<quint32>();
+            d_probed |= MethodsByNameFlags;
+            if( r.d_err != ERR_NOT_IMPLEMENTED )
+            {
+                d_features |= MethodsByNameFlags;
+                decode<Codec::TypeGetMethodsByNameFlags>(r, res);
+                return res.ids;
+            }
+        }
+        const QList<quint32> all = getMethods(typeId);
+        const QByteArrayList names = getMethodNames(all);
+        QList<quint32> found;
+        for( int i = 0; i < all.size(); i++ )
+        {
+            if( names[i] == name )
+                found << all[i];
+        }
+        return found;
+    }
+    cachedCall<Codec::TypeGetMethods>(typeId, res);
+    return res.ids;
+}
+
+quint32 Debugger::getObjectType(quint32 objId)
+{
+    Codec::U32 res;
+    call<Codec::ObjectGetType>(objId, res);
+    return res.value;
+}
+
+QList<Debugger::FieldInfo> Debugger::getFields(quint32 typeId, bool instanceLevel, bool classLevel)
+{
+    Codec::Fields fields;
+    cachedCall<Codec::TypeGetFields>(typeId, fields);
+    QList<Debugger::FieldInfo> res;
+    for( int i = 0; i < fields.fields.size(); i++ )
+    {
+        const bool isStatic = fields.attrs[i] & FIELD_ATTRIBUTE_STATIC;
+#if 0
+        if( isStatic )
+            qDebug() << "static field" << fields.fields[i].name;
+#endif
+        if( ( instanceLevel && !isStatic ) || ( classLevel && isStatic ) )
+            res << fields.fields[i];
+    }
+    return res;
+}
+
+QVariantList Debugger::getValues(quint32 objectOrTypeId, const QList<quint32>& fieldIds, bool typeLevel,
+                                quint32 threadId)
+{
+    ValueBuffer b;
+    getValues(objectOrTypeId, fieldIds, b, typeLevel, threadId);
+    return b.toVariantList();
+}
+
+bool Debugger::getValues(quint32 objectOrTypeId, const QList<quint32>& fieldIds, ValueBuffer& res, bool typeLevel,
+                         quint32 threadId)
+{
+    Reply r;
+    if( typeLevel && threadId != 0 ) // also returns thread static fields
+        r = epochCall<Codec::TypeGetValues2>(Codec::FieldValues(objectOrTypeId, fieldIds, threadId));
+    else if( typeLevel )
+        r = epochCall<Codec::TypeGetValues>(Codec::FieldValues(objectOrTypeId, fieldIds));
+    else
+        r = epochCall<Codec::ObjectGetValues>(Codec::FieldValues(objectOrTypeId, fieldIds));
+    if( !r.isOk() )
+        return false;
+    return res.read(r.d_data, 0, fieldIds.size()) >= 0;
+}
+
+QByteArray Debugger::getAssemblyName(quint32 assemblyId)
+{
+    Codec::String res;
+    cachedCall<Codec::AssemblyGetName>(assemblyId, res);
+    return res.value;
+}
+
+void Debugger::onNewConnection()
+{
+    QTcpSocket* sock = d_srv->nextPendingConnection();
+    //qDebug() << "new connection" << sock->peerName() << sock->peerAddress().toString();
+    if( d_sock || !sock->isOpen() )
+    {
+        sock->close();
+        sock->deleteLater();
+    }else
+    {
+        d_sock = sock;
+        d_status = WaitHandshake;
+        d_rd = d_rel = d_wr = 0;
+        connect( d_sock, SIGNAL(disconnected()), this, SLOT(onDisconnect()));
+        connect( d_sock, SIGNAL(readyRead()), this, SLOT(onData()));
+        onData();
+    }
+}
+
+void Debugger::onError(QAbstractSocket::SocketError)
+{
+    error(d_sock->errorString());
+}
+
+void Debugger::onDisconnect()
+{
+    if( d_sock )
+        d_sock->deleteLater();
+    d_sock = 0;
+    resetSlots();
+    saveCaches();
+    d_stores.clear();
+    clearMetadataCache();
+    d_strings.clear();
+    d_vmVersion = QPair<int,int>();
+    d_features = d_probed = 0;
+    d_epoch++;
+    d_breakPoints.clear();
+    d_requests.clear();
+    d_tracepoints.clear();
+    d_modeReq = 0;
+    d_mode = FreeRun;
+}
+
+void Debugger::onData()
+{
+    if( d_waiting )
+        return; // waitForId() reads the packets itself; don't dispatch events from within a wait
+    while( !d_deferred.isEmpty() )
+    {
+        const QPair<quint8,QByteArray> e = d_deferred.takeFirst();
+        processEvent(e.first, e.second);
+    }
+    readPackets();
+}
+
+void Debugger::readPackets()
+{
+    while( d_sock && d_sock->isOpen() && d_status != ProtocolError )
+    {
+        const quint32 size = d_ring.size();
+        const quint64 space = size - ( d_wr - d_rel );
+        if( space == 0 )
+        {
+            // the packet in work is larger than the ring, or views into the ring are still in use
+            growRing( size * 2 );
+            continue;
+        }
+        const quint32 at = d_wr & ( size - 1 );
+        const qint64 n = d_sock->read( d_ring.data() + at, qMin<quint64>( space, size - at ) );
+        if( n <= 0 )
+            break;
+        d_readAt = d_clock.nsecsElapsed(); // not when parsing is done, which could be after other packets
+        d_wr += n;
+        parsePackets();
+    }
+}
+
+void Debugger::parsePackets()
+{
+    while( d_status != ProtocolError )
+    {
+        const quint64 avail = d_wr - d_rd;
+        if( d_status == WaitHandshake )
+        {
+            if( avail < 13 )
+                return;
+            char msg[13];
+            copyFromRing( d_rd, msg, 13 );
+            d_rd += 13;
+            releaseRing();
+            if( ::memcmp( msg, "DWP-Handshake", 13 ) == 0 )
+            {
+                if( d_sock )
+                    d_sock->write(msg,13);
+                d_status = WaitHeader;
+            }else
+            {
+                error(tr("invalid handshake sequence received"));
+                return;
+            }
+            continue;
+        }
+        // WaitHeader; a packet is only consumed when it is completely in the ring
+        if( avail < 11 )
+            return;
+        char header[11];
+        copyFromRing( d_rd, header, 11 );
+        const quint32 len = readUint32(header);
+        if( len < 11 )
+        {
+            error(tr("invalid packet length"));
+            return;
+        }
+        if( avail < len )
+            return;
+        d_len = len - 11;
+        d_id = readUint32(header + 4);
+        const bool flags = header[8] != 0;
+        if( flags )
+        {
+            // At the moment this value is only used with a reply packet in which case its value is set to 0x80.
+            // A command packet should have this value set to 0.
+            d_cmdSet = 0;
+            d_cmd = 0;
+            const quint16 err = readUint16( header + 9);
+            if( err > 255 )
+            {
+                error(tr("invalid error code in reply"));
+                return;
+            }
+            d_err = err;
+        }else
+        {
+            d_err = 0;
+            d_cmdSet = (quint8)header[9];
+            d_cmd = (quint8)header[10];
+            if( d_cmdSet == 0 )
+            {
+                error(tr("invalid command set in request"));
+                return;
+            }
+        }
+        const quint64 start = d_rd + 11;
+        d_rd += len;
+        if( d_len == 0 )
+            processMessage();
+        else
+        {
+            const quint32 at = start & ( d_ring.size() - 1 );
+            if( at + d_len <= quint32(d_ring.size()) )
+            {
+                // the payload is contiguous in the ring; processMessage copies what it keeps
+                d_views++;
+                processMessage( QByteArray::fromRawData( d_ring.constData() + at, d_len ) );
+                d_views--;
+            }else
+            {
+                // only packets wrapping around the end of the ring are reassembled
+                QByteArray payload( d_len, 0 );
+                copyFromRing( start, payload.data(), d_len );
+                processMessage( payload );
+            }
+        }
+        releaseRing();
+    }
+}
+
+void Debugger::copyFromRing(quint64 pos, char* to, quint32 len) const
+{
+    const quint32 size = d_ring.size();
+    const quint32 at = pos & ( size - 1 );
+    const quint32 n = qMin( len, size - at );
+    ::memcpy( to, d_ring.constData() + at, n );
+    if( n < len )
+        ::memcpy( to + n, d_ring.constData(), len - n );
+}
+
+void Debugger::releaseRing()
+{
+    if( d_views != 0 )
+        return; // a payload view is still in use further up the stack
+    d_rel = d_rd;
+    d_retired.clear();
+    if( d_rel == d_wr )
+    {
+        // empty; restart at the beginning so that the next packets are less likely to wrap
+        d_rd = d_rel = d_wr = 0;
+        if( d_ring.size() > s_ringSize )
+            d_ring = QByteArray( s_ringSize, 0 );
+    }
+}
+
+void Debugger::growRing(quint32 size)
+{
+    QByteArray ring( size, 0 );
+    const quint32 oldMask = d_ring.size() - 1;
+    const quint32 newMask = size - 1;
+    quint64 pos = d_rel;
+    while( pos < d_wr )
+    {
+        const quint32 from = pos & oldMask;
+        const quint32 to = pos & newMask;
+        quint64 n = d_wr - pos;
+        n = qMin<quint64>( n, d_ring.size() - from );
+        n = qMin<quint64>( n, size - to );
+        ::memcpy( ring.data() + to, d_ring.constData() + from, n );
+        pos += n;
+    }
+    if( d_views != 0 )
+        d_retired.append( d_ring ); // keep the memory referenced by the views alive
+    d_ring = ring;
+}
+
+void Debugger::appendToRing(const char* data, quint32 len)
+{
+    while( d_ring.size() - ( d_wr - d_rel ) < len )
+        growRing( d_ring.size() * 2 );
+    const quint32 size = d_ring.size();
+    const quint32 at = d_wr & ( size - 1 );
+    const quint32 n = qMin( len, size - at );
+    ::memcpy( d_ring.data() + at, data, n );
+    if( n < len )
+        ::memcpy( d_ring.data(), data + n, len - n );
+    d_wr += len;
+}
+
+bool Debugger::record(const QString& path)
+{
+    stopRecording();
+    QFile* f = new QFile(path, this);
+    if( !f->open(QIODevice::WriteOnly) )
+    {
+        qCritical() << "cannot open for writing" << path;
+        delete f;
+        return false;
+    }
+    f->write( s_logMagic, 8 );
+    d_log = f;
+    d_logTime = d_clock.nsecsElapsed();
+    return true;
+}
+
+void Debugger::stopRecording()
+{
+    if( d_log == 0 )
+        return;
+    d_log->close();
+    delete d_log;
+    d_log = 0;
+}
+
+void Debugger::logPacket(quint8 kind, quint32 id, quint8 cmdSet, quint8 cmd, quint8 err, const char* data, quint32 len)
+{
+    const qint64 now = d_clock.nsecsElapsed();
+    const qint64 usecs = ( now - d_logTime ) / 1000;
+    d_logTime = now;
+    char entry[16];
+    writeUint32( entry, qMin<qint64>( usecs, 0xffffffff ) );
+    entry[4] = kind;
+    entry[5] = cmdSet;
+    entry[6] = cmd;
+    entry[7] = err;
+    writeUint32( entry + 8, id );
+    writeUint32( entry + 12, len );
+    d_log->write( entry, 16 );
+    d_log->write( data, len );
+}
+
+bool Debugger::replay(const QString& path)
+{
+    if( d_sock != 0 || d_log != 0 )
+        return false;
+    QFile f(path);
+    if( !f.open(QIODevice::ReadOnly) )
+    {
+        qCritical() << "cannot open for reading" << path;
+        return false;
+    }
+    const QByteArray log = f.readAll();
+    if( !log.startsWith(s_logMagic) )
+    {
+        qCritical() << "not a packet log" << path;
+        return false;
+    }
+    d_status = WaitHeader;
+    d_rd = d_rel = d_wr = 0;
+    resetSlots();
+    int off = 8;
+    while( off + 16 <= log.size() && d_status != ProtocolError )
+    {
+        const char* entry = log.constData() + off;
+        const quint8 kind = entry[4];
+        const quint8 cmdSet = entry[5];
+        const quint8 cmd = entry[6];
+        const quint8 err = entry[7];
+        const quint32 id = readUint32( entry + 8 );
+        const quint32 len = readUint32( entry + 12 );
+        off += 16;
+        if( quint32( log.size() - off ) < len )
+        {
+            error(tr("truncated packet log"));
+            break;
+        }
+        if( kind == LogRequest )
+            addPending( id, cmdSet, cmd, 11 + len ); // so that the reply is accepted like on the wire
+        else
+        {
+            // reassemble the packet so that the framing is replayed as well
+            char header[11];
+            writeHeader( header, 11 + len, id, cmdSet, cmd );
+            if( kind == LogReply )
+            {
+                header[8] = 0x80;
+                header[9] = 0;
+                header[10] = err;
+            }
+            appendToRing( header, 11 );
+            appendToRing( log.constData() + off, len );
+            d_readAt = d_clock.nsecsElapsed();
+            parsePackets();
+            if( kind == LogReply )
+            {
+                // nobody waits for replayed replies
+                Slot& slot = d_slots[ id & ( s_slotCount - 1 ) ];
+                if( slot.d_id == id && slot.d_state == SlotReady )
+                    slot = Slot();
+            }
+        }
+        off += len;
+    }
+    const bool ok = d_status != ProtocolError;
+    d_status = WaitHandshake;
+    d_rd = d_rel = d_wr = 0;
+    resetSlots();
+    return ok;
+}
+
+void Debugger::onInitialSetup(bool start)
+{
+    if( !start || !isOpen() )
+        return;
+    QPair<int, int> vVm = vmGetVersion();
+    if( !isOpen() )
+        return;
+    d_vmVersion = vVm;
+    //qDebug() << "VM version" << vVm.first << vVm.second;
+    QPair<int, int> vThis( MAJOR_VERSION, MINOR_VERSION );
+    if( vVm < vThis )
+    {
+        error( tr("the VM is too old for this application" ) );
+        return;
+    }
+    // the replies keep the format of the version requested below; the optional features are probed on first use
+    d_features = d_probed = 0;
+    QByteArray version(8,0);
+    writeUint32(version.data(), MAJOR_VERSION);
+    writeUint32(version.data() + 4, MINOR_VERSION);
+    sendReceive(CMD_SET_VM,CMD_VM_SET_PROTOCOL_VERSION, version );
+
+    // the unload events invalidate the metadata cache
+    const quint8 kinds[] = { DebuggerEvent::ASSEMBLY_LOAD, DebuggerEvent::ASSEMBLY_UNLOAD,
+                             DebuggerEvent::APPDOMAIN_UNLOAD };
+    for( int i = 0; i < 3; i++ )
+    {
+        Codec::U32 id;
+        if( call<Codec::EventRequestSet>(Codec::EventSet(kinds[i], SUSPEND_POLICY_NONE), id) )
+            d_requests.insert(id.value, EventRequest(id.value, kinds[i]));
+    }
+
+    enableExceptionBreaks();
+
+#if 0
+    // not useful
+    QList<quint32> types = findType("System.Diagnostics.Debugger");
+    if( types.size() == 1 )
+    {
+        QList<quint32> meths = getMethods(types.first(),"Break");
+        if( meths.size() == 1 )
+            d_breakMeth = meths.first();
+    }
+#endif
+}
+
+void Debugger::processMessage(const QByteArray& payload)
+{
+    if( d_log )
+    {
+        if( d_cmdSet == 0 )
+        {
+            const Slot& slot = d_slots[ d_id & ( s_slotCount - 1 ) ];
+            const bool known = slot.d_id == d_id;
+            logPacket( LogReply, d_id, known ? slot.d_cmdSet : 0, known ? slot.d_cmd : 0, d_err,
+                       payload.constData(), payload.size() );
+        }else
+            logPacket( LogEvent, d_id, d_cmdSet, d_cmd, 0, payload.constData(), payload.size() );
+    }
+    switch( d_cmdSet )
+    {
+    case 0: // reply
+        {
+            //qDebug() << "reply received id =" << d_id << "err = " << d_err;
+            const quint32 id = d_id;
+            Slot& slot = d_slots[ id & ( s_slotCount - 1 ) ];
+            if( slot.d_id != id )
+            {
+                d_waitStats.orphans++; // unknown id, or the slot was reclaimed
+                break;
+            }
+            CommandStats& cs = cmdStats( slot.d_cmdSet, slot.d_cmd );
+            cs.replies++;
+            cs.replyBytes += 11 + payload.size();
+            if( slot.d_state == SlotAbandoned )
+            {
+                d_waitStats.late++;
+                slot = Slot();
+                break;
+            }
+            if( slot.d_state != SlotPending )
+            {
+                d_waitStats.orphans++; // duplicate reply
+                break;
+            }
+            slot.d_state = SlotReady;
+            slot.d_err = d_err;
+            slot.d_data = QByteArray( payload.constData(), payload.size() ); // payload may be a view into the ring
+            slot.d_arrived = d_readAt;
+            emit sigReply(id);
+        }
+        break;
+    case 64: // Events
+        if( d_waiting )
+        {
+            // dispatched by onData() when back in the event loop
+            if( d_deferred.isEmpty() )
+                QMetaObject::invokeMethod( this, "onData", Qt::QueuedConnection );
+            d_deferred.append( qMakePair(d_cmd, QByteArray( payload.constData(), payload.size() ) ) );
+        }else
+            processEvent(d_cmd, payload);
+        break;
+    default:
+        error( tr("invalid command set %1 received from mono").arg(d_cmdSet));
+        break;
+    }
+}
+
+void Debugger::processEvent( quint8 evt, const QByteArray& payload)
+{
+    // all events of the packet are decoded with one cursor before any of them is dispatched
+    QVector<DebuggerEvent> events;
+    quint8 policy = SUSPEND_POLICY_NONE;
+    try
+    {
+        int off = 0;
+        if( evt == CMD_COMPOSITE )
+        {
+            if( payload.size() < 5 )
+            {
+                error(tr("invalid composite event") );
+                return;
+            }
+            policy = (quint8)payload[0];
+            const quint32 count = readUint32(payload.constData() + 1 );
+            off = 5;
+            events.reserve(count);
+            for( int i = 0; i < count; i++ )
+            {
+                if( off >= payload.size() )
+                    throw 0;
+                DebuggerEvent e;
+                e.event = (quint8)payload[off++];
+                off += readUint32( payload, off, e.request );
+                if( !decodeEvent( payload, off, e ) )
+                    return;
+                events.append(e);
+            }
+        }else
+        {
+            DebuggerEvent e;
+            e.event = evt;
+            e.request = 0;
+            if( !decodeEvent( payload, off, e ) )
+                return;
+            events.append(e);
+        }
+    }catch(...)
     {
-        quint32 count;
-        readUint32(r.d_data,4,count);
-        return count;
+        error( tr("not enough data available") );
+        return;
+    }
+
+    d_epoch++; // the VM was running when it sent the events
+    const bool single = receivers(SIGNAL(sigEvent(DebuggerEvent))) > 0;
+    int traced = 0;
+    int n = 0; // the events not consumed by tracepoints are moved to the front
+    for( int i = 0; i < events.size(); i++ )
+    {
+        DebuggerEvent& e = events[i];
+        if( e.request != 0 )
+        {
+            dispatchEvent(e);
+            QHash<quint32,Tracepoint>::const_iterator t = d_tracepoints.find(e.request);
+            if( t != d_tracepoints.end() )
+            {
+                captureTrace(e, t.value());
+                traced++;
+                continue;
+            }
+        }
+        if( e.event == DebuggerEvent::VM_START )
+        {
+            d_domain = e.object;
+            onInitialSetup(true);
+        }else if( e.event == DebuggerEvent::ASSEMBLY_UNLOAD )
+        {
+            if( d_stores.contains(e.object) )
+            {
+                saveStore(d_stores[e.object]);
+                d_stores.remove(e.object);
+            }
+            invalidateMetadata(e.object);
+        }
+        else if( e.event == DebuggerEvent::APPDOMAIN_UNLOAD )
+            invalidateMetadata(0); // the assemblies of the domain are unloaded with their own events
+        if( single )
+            emit sigEvent(e);
+        if( n != i )
+            events[n] = e;
+        n++;
+    }
+    if( traced == 0 )
+    {
+        emit sigEvents(events);
+        return;
+    }
+    events.resize(n);
+    if( events.isEmpty() && policy != SUSPEND_POLICY_NONE )
+        sendReceive(CMD_SET_VM,CMD_VM_RESUME); // only tracepoints were hit; the values are captured
+    emit sigTraceRecords();
+    if( !events.isEmpty() )
+        emit sigEvents(events);
+}
+
+void Debugger::dispatchEvent(DebuggerEvent& e)
+{
+    QHash<quint32,EventRequest>::iterator i = d_requests.find(e.request);
+    if( i == d_requests.end() )
+        return; // e.g. an event of a step request already cleared
+    EventRequest& r = i.value();
+    r.hits++;
+    switch( r.kind )
+    {
+    case DebuggerEvent::BREAKPOINT:
+        // the location is known from the request; Mono3 on macOS reports an invalid offset
+        e.object = r.method;
+        e.offset = r.iloffset;
+        break;
+    default:
+        break;
     }
-    return 0;
 }
 
-QByteArrayList Debugger::getParamNames(quint32 methodId)
+bool Debugger::decodeEvent(const QByteArray& payload, int& off, DebuggerEvent& e)
+{
+    e.object = 0;
+    e.offset = 0;
+    //qDebug() << "event" << e.event << "arrived with payload len" << payload.size();
+    off += readUint32(payload,off,e.thread);
+    switch( e.event )
+    {
+    case DebuggerEvent::VM_START:
+        off += readUint32( payload, off, e.object ); // domainId
+        break;
+    case DebuggerEvent::VM_DEATH:
+        {
+            quint32 exitCode;
+            if( off < payload.size() )
+            {
+                off += readUint32( payload, off, exitCode );
+                e.exitCode = exitCode;
+            }else
+                e.exitCode = 0;
+        }
+        break;
+    case DebuggerEvent::THREAD_START:
+    case DebuggerEvent::THREAD_DEATH:
+        e.object = e.thread;
+        break;
+    case DebuggerEvent::APPDOMAIN_CREATE:
+    case DebuggerEvent::APPDOMAIN_UNLOAD:
+        off += readUint32( payload, off, e.object ); // domainId
+        break;
+    case DebuggerEvent::METHOD_ENTRY:
+    case DebuggerEvent::METHOD_EXIT:
+        off += readUint32( payload, off, e.object ); // methodId
+        break;
+    case DebuggerEvent::ASSEMBLY_LOAD:
+    case DebuggerEvent::ASSEMBLY_UNLOAD:
+        off += readUint32( payload, off, e.object ); // assemblyId
+        break;
+    case DebuggerEvent::BREAKPOINT:
+    case DebuggerEvent::STEP:
+        {
+            off += readUint32( payload, off, e.object ); // methodId
+            quint64 il_offset;
+            off += readUint64( payload, off, il_offset );
+            if( il_offset > std::numeric_limits<quint32>::max() )
+            {
+                e.offset = 0;
+#if 0
+                // this value is not used anyway and on macOS 0xffffffffff is returned by Mono3
+                e.offset = std::numeric_limits<quint32>::max();
+                qWarning() << "value exceeds maximum offset" << il_offset;
+#endif
+            }else
+                e.offset = il_offset;
+        }
+        break;
+    case DebuggerEvent::TYPE_LOAD:
+        off += readUint32( payload, off, e.object ); // typeId
+        break;
+    case DebuggerEvent::EXCEPTION:
+        off += readUint32( payload, off, e.object ); // objectId
+        break;
+    case DebuggerEvent::KEEPALIVE:
+        // suspend_policy = SUSPEND_POLICY_NONE;
+        break;
+    case DebuggerEvent::USER_BREAK:
+        break;
+    case DebuggerEvent::USER_LOG:
+        {
+            quint32 level;
+            off += readUint32( payload, off, level );
+            e.level = level;
+            QByteArray category;
+            off += readString( payload, off, category );
+            QByteArray message;
+            off += readString( payload, off, message );
+            e.msg = category + "\n" + message;
+        }
+        break;
+    default:
+        error( tr("invalid event %1 %2").arg(e.event).arg(payload.toHex().constData()) );
+        return false;
+    }
+    return true;
+}
+
+quint32 Debugger::sendRequest(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
+{
+    if( d_sock == 0 )
+        return 0;
+    QByteArray packet(11 + payload.size(),0);
+    ::memcpy( packet.data() + 11, payload.constData(), payload.size() );
+    return sendPacket( cmdSet, cmd, packet );
+}
+
+quint32 Debugger::sendPacket(quint8 cmdSet, quint8 cmd, QByteArray& packet)
+{
+    if( d_sock == 0 )
+        return 0;
+    const quint32 id = nextId();
+    writeHeader( packet.data(), packet.size(), id, cmdSet, cmd );
+    addPending( id, cmdSet, cmd, packet.size() );
+    d_sock->write( packet );
+    if( d_log )
+        logPacket( LogRequest, id, cmdSet, cmd, 0, packet.constData() + 11, packet.size() - 11 );
+    //qDebug() << "request sent id =" << id << "cmd_set =" << cmdSet << "cmd =" << cmd;
+    return id;
+}
+
+template<class Command>
+bool Debugger::call(const typename Command::Request& req, typename Command::Reply& rep)
+{
+    Codec::Encoder e(d_packet);
+    req.encode(e);
+    const quint32 id = sendPacket(Command::Set, Command::Cmd, d_packet);
+    if( id == 0 )
+        return false;
+    const Reply r = waitForId(id);
+    if( r.d_timeout )
+    {
+        error(tr("timeout in request %1.%2").arg(int(Command::Set)).arg(int(Command::Cmd)) );
+        return false;
+    }
+    return decode<Command>(r, rep);
+}
+
+template<class Command>
+bool Debugger::decode(const Reply& r, typename Command::Reply& rep)
+{
+    if( !r.isOk() )
+        return false;
+    Codec::Decoder d(r.d_data);
+    rep.decode(d);
+    if( !d.ok() )
+        error(tr("invalid reply to request %1.%2").arg(int(Command::Set)).arg(int(Command::Cmd)) );
+    return d.ok();
+}
+
+template<class Command>
+bool Debugger::cachedCall(quint32 id, typename Command::Reply& rep)
+{
+    const Reply r = cachedReceive(Command::Set, Command::Cmd, id);
+    if( !r.isOk() )
+        return false;
+    Codec::Decoder d(r.d_data);
+    rep.decode(d);
+    if( d.ok() )
+        return true;
+    // also replies from the disk cache; the malformed reply is not kept
+    qWarning() << "invalid reply to metadata request" << int(Command::Set) << int(Command::Cmd) << id;
+    d_meta.remove( MetaKey( ( Command::Set << 8 ) | Command::Cmd, id ) );
+    rep = typename Command::Reply();
+    return false;
+}
+
+template<class Command>
+Debugger::Reply Debugger::epochCall(const typename Command::Request& req)
+{
+    return epochReceive(Command::Set, Command::Cmd, Codec::payload(req));
+}
+
+Debugger::CommandStats& Debugger::cmdStats(quint8 cmdSet, quint8 cmd)
+{
+    // the stats may have been reset while the request was in flight
+    const quint16 key = ( cmdSet << 8 ) | cmd;
+    QMap<quint16,CommandStats>::iterator i = d_cmdStats.find(key);
+    if( i == d_cmdStats.end() )
+        i = d_cmdStats.insert( key, CommandStats(cmdSet,cmd) );
+    return i.value();
+}
+
+void Debugger::addPending(quint32 id, quint8 cmdSet, quint8 cmd, quint32 bytes)
+{
+    CommandStats& cs = cmdStats(cmdSet, cmd);
+    cs.requests++;
+    cs.requestBytes += bytes;
+    if( ( cmdSet == CMD_SET_VM && ( cmd == CMD_VM_RESUME || cmd == CMD_VM_SUSPEND ||
+                                    cmd == CMD_VM_INVOKE_METHOD || cmd == CMD_VM_INVOKE_METHODS ) ) ||
+            ( cmdSet == CMD_SET_STACK_FRAME && cmd == CMD_STACK_FRAME_SET_VALUES ) ||
+            ( cmdSet == CMD_SET_OBJECT_REF && cmd == CMD_OBJECT_REF_SET_VALUES ) ||
+            ( cmdSet == CMD_SET_ARRAY_REF && cmd == CMD_ARRAY_REF_SET_VALUES ) ||
+            ( cmdSet == CMD_SET_TYPE && cmd == CMD_TYPE_SET_VALUES ) )
+        d_epoch++; // the VM runs, stops or values change; frames and values fetched so far are stale
+
+    Slot& slot = d_slots[ id & ( s_slotCount - 1 ) ];
+    if( slot.d_state == SlotPending || slot.d_state == SlotReady )
+        d_waitStats.reclaimed++; // posted but never taken; a waiter for it would now get an invalid reply
+    slot.d_id = id;
+    slot.d_state = SlotPending;
+    slot.d_cmdSet = cmdSet;
+    slot.d_cmd = cmd;
+    slot.d_err = 0;
+    slot.d_data.clear();
+    slot.d_sent = d_clock.nsecsElapsed();
+    slot.d_arrived = 0;
+    slot.d_deadline = d_clock.elapsed() + getTimeout(cmdSet);
+}
+
+void Debugger::resetSlots()
+{
+    for( int i = 0; i < d_slots.size(); i++ )
+        d_slots[i] = Slot();
+}
+
+quint32 Debugger::nextId()
+{
+    const quint32 id = d_nextId++;
+    if( d_nextId == 0 )
+        d_nextId = 1; // 0 is reserved for "no request"
+    return id;
+}
+
+bool Debugger::error(const QString& msg)
+{
+    d_status = ProtocolError;
+    if( d_sock )
+        d_sock->close();
+    qCritical() << msg;
+    emit sigError(msg);
+    return false;
+}
+
+Debugger::Reply Debugger::waitForId(quint32 id)
+{
+    Reply res = fetchReply(id);
+    if( res.d_valid || d_sock == 0 )
+        return res;
+    const int index = id & ( s_slotCount - 1 );
+    if( d_slots[index].d_id != id )
+        return res; // not a request in flight
+    const qint64 deadline = d_slots[index].d_deadline;
+    d_waiting++;
+    while( d_sock && d_sock->isOpen() )
+    {
+        const qint64 left = deadline - d_clock.elapsed();
+        if( left <= 0 )
+        {
+            // the slot is reclaimed when the late reply arrives or when the slot is reused
+            if( d_slots[index].d_id == id )
+            {
+                d_slots[index].d_state = SlotAbandoned;
+                cmdStats( d_slots[index].d_cmdSet, d_slots[index].d_cmd ).timeouts++;
+            }
+            res.d_timeout = true;
+            break;
+        }
+        // returns as soon as new data is available; readyRead is ignored by onData while d_waiting
+        if( d_sock->bytesAvailable() == 0 )
+            d_sock->waitForReadyRead(left);
+        readPackets();
+        const Slot& slot = d_slots[index];
+        if( slot.d_id != id )
+            break; // reclaimed by a newer request
+        if( slot.d_state != SlotReady )
+            continue;
+        res = fetchReply(id);
+        break;
+    }
+    d_waiting--;
+    if( d_waiting == 0 && !d_deferred.isEmpty() )
+        QMetaObject::invokeMethod( this, "onData", Qt::QueuedConnection );
+    return res;
+}
+
+Debugger::Reply Debugger::sendReceive(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
+{
+    const quint32 id = sendRequest( cmdSet, cmd, payload);
+    Reply rep = waitForId(id);
+    if( rep.d_timeout )
+    {
+        error(tr("timeout in request %1.%2").arg(cmdSet).arg(cmd) );
+        return rep;
+    }else
+        return rep;
+}
+
+Debugger::Reply Debugger::cachedReceive(quint8 cmdSet, quint8 cmd, quint32 id)
 {
+    const MetaKey key( ( cmdSet << 8 ) | cmd, id );
+    QHash<MetaKey,QByteArray>::const_iterator i = d_meta.find(key);
+    Reply r;
+    if( i != d_meta.end() )
+    {
+        r.d_valid = true;
+        r.d_data = i.value();
+        return r;
+    }
+    if( isPersistent(cmdSet, cmd) && fromStore(cmd, id, r.d_data, true) )
+    {
+        r.d_valid = true;
+        if( !hasTypeIds(cmd) )
+            d_meta.insert( key, r.d_data );
+        return r;
+    }
     QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_PARAM_INFO,data);
-    QByteArrayList res;
+    writeUint32(data.data(),id);
+    r = sendReceive(cmdSet, cmd, data);
     if( r.isOk() )
+        rememberMetadata( key, r.d_data );
+    return r;
+}
+
+bool Debugger::isPersistent(quint8 cmdSet, quint8 cmd) const
+{
+    // the replies of these commands only depend on the method token and are kept on disk
+    return !d_cacheDir.isEmpty() && cmdSet == CMD_SET_METHOD &&
+            ( cmd == CMD_METHOD_GET_NAME || cmd == CMD_METHOD_GET_DEBUG_INFO ||
+              cmd == CMD_METHOD_GET_PARAM_INFO || cmd == CMD_METHOD_GET_LOCALS_INFO );
+}
+
+Debugger::MetaStore* Debugger::methodStore(quint32 methodId, quint32& token, bool fetch)
+{
+    // without fetch only what is already known is used, i.e. no round trips
+    token = 0;
+    if( fetch )
+    {
+        // the token and the declaring type with one round trip; the assembly of the type is usually known
+        Batch b;
+        QList<MetaKey> keys;
+        QList<quint32> ids;
+        ids << methodId;
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_INFO, ids);
+        addMetadataRequests(b, keys, CMD_SET_METHOD, CMD_METHOD_GET_DECLARING_TYPE, ids);
+        executeMetadata(b, keys);
+        const quint32 type = d_methodType.value(methodId);
+        if( type && !d_typeAssembly.contains(type) )
+            getTypeInfo(type);
+    }
+    const QByteArray reply = d_meta.value( MetaKey( ( CMD_SET_METHOD << 8 ) | CMD_METHOD_GET_INFO, methodId ) );
+    Codec::Decoder d(reply);
+    Codec::MethodInfo info;
+    info.decode(d);
+    if( !d.ok() )
+        return 0;
+    token = info.token;
+    const quint32 assembly = d_typeAssembly.value(d_methodType.value(methodId));
+    if( fetch && assembly )
+        return getStore(assembly);
+
+    QHash<quint32,MetaStore>::iterator i = d_stores.find(assembly);
+    if( assembly == 0 || i == d_stores.end() || i.value().path.isEmpty() )
+        return 0;
+    return &i.value();
+}
+
+bool Debugger::fromStore(quint8 cmd, quint32 methodId, QByteArray& reply, bool fetch)
+{
+    quint32 token;
+    MetaStore* store = methodStore(methodId, token, fetch);
+    if( store == 0 || token == 0 )
+        return false;
+    QHash<quint64,QByteArray>::const_iterator i = store->replies.find( ( quint64(cmd) << 32 ) | token );
+    if( i == store->replies.end() )
+        return false;
+    reply = i.value();
+    return true;
+}
+
+void Debugger::rememberMetadata(const MetaKey& key, const QByteArray& reply)
+{
+    d_meta.insert( key, reply );
+    const quint8 cmdSet = key.first >> 8;
+    const quint8 cmd = key.first & 0xff;
+    const quint32 id = key.second;
+    if( isPersistent(cmdSet, cmd) )
     {
-        quint32 count;
-        readUint32(r.d_data,4,count);
-        int off = 8 // calling convention + param count
-                + 4 // generic parameter count
-                + 4 // TypeID of the returned value
-                + count * 4; // parameter count TypeID for each parameter type
-        for( int i = 0; i < count; i++ )
+        quint32 token;
+        MetaStore* store = methodStore(id, token, false);
+        if( store && token )
         {
-            QByteArray name;
-            off += readString(r.d_data,off,name);
-            res << name;
+            store->replies.insert( ( quint64(cmd) << 32 ) | token, reply );
+            store->dirty = true;
         }
     }
-    return res;
+    // remember the assembly of each type and the type of each method for invalidateMetadata(); the caller
+    // reports malformed replies
+    Codec::Decoder d(reply);
+    if( cmdSet == CMD_SET_TYPE && cmd == CMD_TYPE_GET_INFO )
+    {
+        Codec::TypeInfo type;
+        type.decode(d);
+        if( d.ok() )
+            d_typeAssembly[id] = type.info.assembly;
+    }else if( cmdSet == CMD_SET_METHOD && cmd == CMD_METHOD_GET_DECLARING_TYPE )
+    {
+        Codec::U32 type;
+        type.decode(d);
+        if( d.ok() )
+            d_methodType[id] = type.value;
+    }
+}
+
+void Debugger::addMetadataRequests(Batch& b, QList<MetaKey>& keys, quint8 cmdSet, quint8 cmd,
+                                   const QList<quint32>& ids)
+{
+    QByteArray data(4,0);
+    for( int i = 0; i < ids.size(); i++ )
+    {
+        const MetaKey key( ( cmdSet << 8 ) | cmd, ids[i] );
+        if( ids[i] == 0 || d_meta.contains(key) )
+            continue;
+        QByteArray reply;
+        if( isPersistent(cmdSet, cmd) && !hasTypeIds(cmd) && fromStore(cmd, ids[i], reply, false) )
+        {
+            d_meta.insert( key, reply );
+            continue;
+        }
+        writeUint32(data.data(),ids[i]);
+        b.add(cmdSet, cmd, data);
+        keys << key;
+    }
+}
+
+void Debugger::executeMetadata(Batch& b, QList<MetaKey>& keys)
+{
+    if( b.isEmpty() )
+        return;
+    const QList<Reply> r = execute(b);
+    for( int i = 0; i < r.size(); i++ )
+    {
+        if( r[i].isOk() )
+            rememberMetadata( keys[i], r[i].d_data );
+    }
+    b.clear();
+    keys.clear();
+}
+
+void Debugger::invalidateMetadata(quint32 assembly)
+{
+    // entries whose assembly is not known are dropped in any case
+    QHash<MetaKey,QByteArray>::iterator i = d_meta.begin();
+    while( i != d_meta.end() )
+    {
+        const quint8 cmdSet = i.key().first >> 8;
+        const quint32 id = i.key().second;
+        quint32 owner = 0;
+        if( cmdSet == CMD_SET_ASSEMBLY )
+            owner = id;
+        else if( cmdSet == CMD_SET_TYPE )
+            owner = d_typeAssembly.value(id);
+        else if( cmdSet == CMD_SET_METHOD )
+            owner = d_typeAssembly.value(d_methodType.value(id));
+        if( owner == 0 || owner == assembly )
+            i = d_meta.erase(i);
+        else
+            ++i;
+    }
+    if( assembly == 0 )
+        return;
+    QHash<quint32,quint32>::iterator j = d_typeAssembly.begin();
+    while( j != d_typeAssembly.end() )
+    {
+        if( j.value() == assembly )
+            j = d_typeAssembly.erase(j);
+        else
+            ++j;
+    }
+    QHash<quint32,quint32>::iterator k = d_methodType.begin();
+    while( k != d_methodType.end() )
+    {
+        if( !d_typeAssembly.contains(k.value()) )
+            k = d_methodType.erase(k);
+        else
+            ++k;
+    }
+}
+
+bool Debugger::fromEpochCache(const EpochKey& key, Debugger::Reply& r)
+{
+    if( d_cacheEpoch != d_epoch )
+    {
+        d_epochCache.clear();
+        d_cacheEpoch = d_epoch;
+        return false;
+    }
+    QHash<EpochKey,QByteArray>::const_iterator i = d_epochCache.find(key);
+    if( i == d_epochCache.end() )
+        return false;
+    r = Reply();
+    r.d_valid = true;
+    r.d_data = i.value();
+    return true;
+}
+
+void Debugger::toEpochCache(const EpochKey& key, const Debugger::Reply& r)
+{
+    if( r.isOk() && d_cacheEpoch == d_epoch )
+        d_epochCache.insert( key, r.d_data );
+}
+
+Debugger::Reply Debugger::epochReceive(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
+{
+    const EpochKey key( ( cmdSet << 8 ) | cmd, payload );
+    Reply r;
+    if( fromEpochCache(key,r) )
+        return r;
+    r = sendReceive(cmdSet, cmd, payload);
+    toEpochCache(key,r);
+    return r;
+}
+
+bool Debugger::hasTypeIds(quint8 cmd)
+{
+    // the type ids in these replies are only valid in the session which stored them; the stored replies are
+    // used for names and counts, and batches which need the types (i.e. getFrameSnapshot) ask the VM
+    return cmd == CMD_METHOD_GET_PARAM_INFO || cmd == CMD_METHOD_GET_LOCALS_INFO;
+}
+
+bool Debugger::isValidRecord(quint64 key, const QByteArray& reply)
+{
+    Codec::Decoder d(reply);
+    switch( key >> 32 )
+    {
+    case CMD_METHOD_GET_NAME:
+        {
+            Codec::String r;
+            r.decode(d);
+        }
+        break;
+    case CMD_METHOD_GET_DEBUG_INFO:
+        {
+            Codec::DebugInfo r;
+            r.decode(d);
+        }
+        break;
+    case CMD_METHOD_GET_PARAM_INFO:
+        {
+            Codec::ParamInfo r;
+            r.decode(d);
+        }
+        break;
+    case CMD_METHOD_GET_LOCALS_INFO:
+        {
+            Codec::LocalsInfo r;
+            r.decode(d);
+        }
+        break;
+    default:
+        return false;
+    }
+    return d.ok() && d.pos() == reply.size();
 }
 
-quint16 Debugger::getLocalsCount(quint32 methodId)
+Debugger::MetaStore* Debugger::getStore(quint32 assemblyId)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_LOCALS_INFO,data);
-    if( r.isOk() )
+    QHash<quint32,MetaStore>::iterator i = d_stores.find(assemblyId);
+    if( i != d_stores.end() )
+        return i.value().path.isEmpty() ? 0 : &i.value();
+    MetaStore& store = d_stores[assemblyId];
+
+    // the store is named by the module GUID (as written by MdbGen) and only used if the module file has the
+    // same content; the file is only hashed if the VM runs on this machine
+    Codec::U32 module;
+    Codec::ModuleInfo info;
+    if( !call<Codec::AssemblyGetManifestModule>(assemblyId, module) ||
+            !call<Codec::ModuleGetInfo>(module.value, info) || info.guid.isEmpty() )
+        return 0;
+    QFile file( QString::fromUtf8(info.fullName) );
+    if( file.open(QIODevice::ReadOnly) )
     {
-        quint32 count;
-        readUint32(r.d_data,0,count);
-        return count;
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(&file);
+        store.hash = hash.result();
     }
-    return 0;
-}
+    info.guid.replace("{","").replace("}","");
+    store.path = d_cacheDir + "/" + QString::fromLatin1(info.guid) + ".mdc";
 
-QByteArrayList Debugger::getLocalNames(quint32 methodId)
-{
-    QByteArray data(4,0);
-    writeUint32(data.data(),methodId);
-    Reply r = sendReceive(CMD_SET_METHOD, CMD_METHOD_GET_LOCALS_INFO,data);
-    QByteArrayList res;
-    if( r.isOk() )
+    QFile in(store.path);
+    if( in.open(QIODevice::ReadOnly) )
     {
-        quint32 count;
-        readUint32(r.d_data,0,count);
-        int off = 4 + count * 4; // followed by the TypeID (id) for each locals
-        for( int i = 0; i < count; i++ )
+        QDataStream s(&in);
+        quint32 magic = 0;
+        s >> magic;
+        if( magic == s_storeMagic )
         {
-            QByteArray name;
-            off += readString(r.d_data,off,name);
-            res << name;
+            QByteArray hash;
+            s >> hash;
+            if( hash == store.hash )
+                s >> store.replies;
+        }
+        bool ok = s.status() == QDataStream::Ok;
+        QHash<quint64,QByteArray>::const_iterator j;
+        for( j = store.replies.begin(); ok && j != store.replies.end(); ++j )
+            ok = isValidRecord(j.key(), j.value());
+        if( !ok )
+        {
+            qWarning() << "discarding invalid metadata cache" << store.path;
+            store.replies.clear();
         }
     }
-    return res;
+    return &store;
 }
 
-Debugger::TypeInfo Debugger::getTypeInfo(quint32 typeId)
+void Debugger::saveStore(Debugger::MetaStore& store)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),typeId);
-    Reply r = sendReceive(CMD_SET_TYPE, CMD_TYPE_GET_INFO,data);
-    TypeInfo res;
-    res.id = 0;
-    res.assembly = 0;
-    res.module = 0;
-    if( r.isOk() )
+    if( !store.dirty || store.path.isEmpty() )
+        return;
+    QFile out(store.path);
+    if( !out.open(QIODevice::WriteOnly) )
     {
-        int off = 0;
-        off += readString(r.d_data,off,res.space);
-        off += readString(r.d_data,off,res.name);
-        off += readString(r.d_data,off,res.fullName);
-        off += readUint32(r.d_data,off,res.assembly);
-        off += readUint32(r.d_data,off,res.module);
-        off += readUint32(r.d_data,off,res.id);
+        qCritical() << "cannot write metadata cache" << store.path;
+        return;
     }
-    return res;
+    QDataStream s(&out);
+    s << s_storeMagic << store.hash << store.replies;
+    store.dirty = false;
 }
 
-quint32 Debugger::getTypeObject(quint32 typeId)
+void Debugger::setCacheDir(const QString& path)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),typeId);
-    Reply r = sendReceive(CMD_SET_TYPE, CMD_TYPE_GET_OBJECT,data);
-    if( r.isOk() )
-        return readUint32(r.d_data.constData());
-    return 0;
+    saveCaches();
+    d_stores.clear();
+    d_cacheDir = path;
+    if( !path.isEmpty() )
+        QDir().mkpath(path);
 }
 
-QList<quint32> Debugger::getMethods(quint32 typeId, const QByteArray& name)
+void Debugger::saveCaches()
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),typeId);
-    Reply r = sendReceive(CMD_SET_TYPE, CMD_TYPE_GET_METHODS,data);
-    QList<quint32> res;
-    if( r.isOk() )
-    {
-        quint32 len;
-        int off = 0;
-        off += readUint32(r.d_data,off,len);
-        for( int i = 0; i < len; i++ )
-        {
-            quint32 m;
-            off += readUint32(r.d_data,off,m);
-            if( !name.isEmpty() )
-            {
-                const QByteArray check = getMethodName(m);
-                if( name == check )
-                    res << m;
-            }else
-                res << m;
-        }
-    }
-    return res;
+    QHash<quint32,MetaStore>::iterator i;
+    for( i = d_stores.begin(); i != d_stores.end(); ++i )
+        saveStore(i.value());
 }
 
-quint32 Debugger::getObjectType(quint32 objId)
+void Debugger::clearMetadataCache()
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),objId);
-    Reply r = sendReceive(CMD_SET_OBJECT_REF, CMD_OBJECT_REF_GET_TYPE,data);
-    if( r.isOk() )
-        return readUint32(r.d_data.constData());
-    return 0;
+    d_meta.clear();
+    d_typeAssembly.clear();
+    d_methodType.clear();
 }
 
-QList<Debugger::FieldInfo> Debugger::getFields(quint32 typeId, bool instanceLevel, bool classLevel)
+Debugger::EventRequest Debugger::getEventRequest(quint32 requestId) const
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),typeId);
-    Reply r = sendReceive(CMD_SET_TYPE, CMD_TYPE_GET_FIELDS,data);
-    QList<Debugger::FieldInfo> res;
-    if( r.isOk() )
-    {
-        int off = 0;
-        quint32 count;
-        off += readUint32(r.d_data,off,count);
-        for( int i = 0; i < count; i++ )
-        {
-            FieldInfo field;
-            off += readUint32(r.d_data,off,field.id);
-            off += readString(r.d_data,off,field.name);
-            off += 4; // skip type
-            quint32 attrs;
-            off += readUint32(r.d_data,off,attrs);
-            const bool isStatic = attrs & FIELD_ATTRIBUTE_STATIC;
-#if 0
-            if( isStatic )
-                qDebug() << "static field" << field.name;
-#endif
-            if( ( instanceLevel && !isStatic ) || ( classLevel && isStatic ) )
-                res << field;
-        }
-    }
-    return res;
+    return d_requests.value(requestId);
 }
 
-QVariantList Debugger::getValues(quint32 objectOrTypeId, const QList<quint32>& fieldIds, bool typeLevel)
+quint32 Debugger::post(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
 {
-    QByteArray data(4 + 4 + 4 * fieldIds.size() ,0);
-    writeUint32(data.data(),objectOrTypeId);
-    writeUint32(data.data()+4, fieldIds.size());
-    for( int i = 0; i < fieldIds.size(); i++ )
-        writeUint32(data.data()+8+i*4, fieldIds[i]);
-    Reply r;
-    if( typeLevel )
-        r = sendReceive(CMD_SET_TYPE, CMD_TYPE_GET_VALUES,data);
-    else
-        r = sendReceive(CMD_SET_OBJECT_REF, CMD_OBJECT_REF_GET_VALUES,data);
-    QVariantList res;
-    if( r.isOk() )
-    {
-        int off = 0;
-        for( int i = 0; i < fieldIds.size(); i++ )
-        {
-            QVariant var;
-            off += readValue(r.d_data,off,var);
-            res << var;
-        }
-    }
-    return res;
+    if( !isOpen() )
+        return 0;
+    return sendRequest(cmdSet, cmd, payload);
 }
 
-QByteArray Debugger::getAssemblyName(quint32 assemblyId)
+void Debugger::setTimeout(quint8 cmdSet, int msecs)
 {
-    QByteArray data(4,0);
-    writeUint32(data.data(),assemblyId);
-    Reply r = sendReceive(CMD_SET_ASSEMBLY, CMD_ASSEMBLY_GET_NAME,data);
-    if( r.isOk() )
-        return readString(r.d_data.constData());
-    else
-        return QByteArray();
+    d_timeouts[cmdSet] = msecs;
 }
 
-void Debugger::onNewConnection()
+int Debugger::getTimeout(quint8 cmdSet) const
 {
-    QTcpSocket* sock = d_srv->nextPendingConnection();
-    //qDebug() << "new connection" << sock->peerName() << sock->peerAddress().toString();
-    if( d_sock || !sock->isOpen() )
-    {
-        sock->close();
-        sock->deleteLater();
-    }else
-    {
-        d_sock = sock;
-        d_status = WaitHandshake;
-        connect( d_sock, SIGNAL(disconnected()), this, SLOT(onDisconnect()));
-        connect( d_sock, SIGNAL(readyRead()), this, SLOT(onData()));
-        onData();
-    }
+    return d_timeouts.value(cmdSet, s_defaultTimeout);
 }
 
-void Debugger::onError(QAbstractSocket::SocketError)
+bool Debugger::isReady(quint32 id) const
 {
-    error(d_sock->errorString());
+    const Slot& slot = d_slots[ id & ( s_slotCount - 1 ) ];
+    return slot.d_id == id && slot.d_state == SlotReady;
 }
 
-void Debugger::onDisconnect()
+Debugger::Reply Debugger::take(quint32 id)
 {
-    if( d_sock )
-        d_sock->deleteLater();
-    d_sock = 0;
-    d_breakPoints.clear();
-    d_modeReq = 0;
-    d_mode = FreeRun;
+    if( id == 0 )
+        return Reply();
+    Reply rep = waitForId(id);
+    if( rep.d_timeout )
+        error(tr("timeout in request id %1").arg(id) );
+    return rep;
 }
 
-void Debugger::onData()
+QList<Debugger::Reply> Debugger::takeAll(const QList<quint32>& ids)
+{
+    // replies may arrive in any order; waitForId() collects all of them on the way
+    QList<Reply> res;
+    for( int i = 0; i < ids.size(); i++ )
+        res << take(ids[i]);
+    return res;
+}
+
+QList<quint32> Debugger::post(Debugger::Batch& b)
 {
-    while( d_sock && d_sock->isOpen() && d_sock->bytesAvailable() )
+    QList<quint32> ids;
+    if( !isOpen() || b.isEmpty() )
+        return ids;
+    char* buf = b.d_buf.data();
+    for( int i = 0; i < b.d_offs.size(); i++ )
+    {
+        const quint32 id = nextId();
+        char* p = buf + b.d_offs[i];
+        writeUint32( p + 4, id );
+        addPending( id, p[9], p[10], readUint32(p) );
+        ids << id;
+    }
+    d_sock->write( b.d_buf );
+    if( d_log )
     {
-        switch( d_status )
+        for( int i = 0; i < b.d_offs.size(); i++ )
         {
-        case WaitHandshake:
-            if( d_sock->bytesAvailable() >= 13 )
-            {
-                const QByteArray msg = d_sock->read(13);
-                if( msg == "DWP-Handshake" )
-                {
-                    d_sock->write(msg);
-                    d_status = WaitHeader;
-                }else
-                {
-                    error(tr("invalid handshake sequence received"));
-                    return;
-                }
-            }else
-                return;
-            break;
-        case WaitHeader:
-            if( d_sock->bytesAvailable() >= 11 )
-            {
-                const QByteArray header = d_sock->read(11);
-                d_len = readUint32(header.constData()) - 11;
-                d_id = readUint32(header.constData() + 4);
-                const bool flags = header[8] != 0;
-                if( flags )
-                {
-                    // At the moment this value is only used with a reply packet in which case its value is set to 0x80.
-                    // A command packet should have this value set to 0.
-                    d_cmdSet = 0;
-                    d_cmd = 0;
-                    const quint16 err = readUint16( header.constData() + 9);
-                    if( err > 255 )
-                    {
-                        error(tr("invalid error code in reply"));
-                        return;
-                    }
-                    d_err = err;
-                }else
-                {
-                    d_err = 0;
-                    d_cmdSet = (quint8)header[9];
-                    d_cmd = (quint8)header[10];
-                    if( d_cmdSet == 0 )
-                    {
-                        error(tr("invalid command set in request"));
-                        return;
-                    }
-                }
-                if( d_len > 0 )
-                    d_status = WaitData;
-                else
-                    processMessage();
-            }else
-                return;
-            break;
-        case WaitData:
-            if( d_sock->bytesAvailable() >= d_len )
-            {
-                d_status = WaitHeader;
-                processMessage(d_sock->read(d_len));
-            }else
-                return;
-            break;
+            const char* p = buf + b.d_offs[i];
+            logPacket( LogRequest, ids[i], p[9], p[10], 0, p + 11, readUint32(p) - 11 );
         }
     }
+    return ids;
 }
 
-void Debugger::onInitialSetup(bool start)
+QList<Debugger::Reply> Debugger::execute(Debugger::Batch& b)
 {
-    if( !start || !isOpen() )
-        return;
-    QPair<int, int> vVm = vmGetVersion();
-    if( !isOpen() )
-        return;
-    //qDebug() << "VM version" << vVm.first << vVm.second;
-    QPair<int, int> vThis( MAJOR_VERSION, MINOR_VERSION );
-    if( vVm < vThis )
+    if( b.size() > s_slotCount / 2 )
     {
-        error( tr("the VM is too old for this application" ) );
-        return;
+        // more requests in flight than slots would reclaim the slots of the first ones before they are taken
+        QList<Reply> res;
+        for( int i = 0; i < b.size(); i += s_slotCount / 2 )
+        {
+            const int n = qMin( s_slotCount / 2, b.size() - i );
+            const int end = i + n < b.size() ? b.d_offs[i + n] : b.d_buf.size();
+            Batch part;
+            part.d_buf = b.d_buf.mid( b.d_offs[i], end - b.d_offs[i] );
+            for( int j = i; j < i + n; j++ )
+                part.d_offs << b.d_offs[j] - b.d_offs[i];
+            res += execute(part);
+        }
+        return res;
     }
-    QByteArray version(8,0);
-    writeUint32(version.data(), MAJOR_VERSION);
-    writeUint32(version.data() + 4, MINOR_VERSION);
-    sendReceive(CMD_SET_VM,CMD_VM_SET_PROTOCOL_VERSION, version );
-
-    QByteArray event(3,0);
-    event[0] = DebuggerEvent::ASSEMBLY_LOAD;
-    event[1] = SUSPEND_POLICY_NONE;
-    event[2] = 0;
-    sendReceive(CMD_SET_EVENT_REQUEST,CMD_EVENT_REQUEST_SET, event);
-
-    enableExceptionBreaks();
-
-#if 0
-    // not useful
-    QList<quint32> types = findType("System.Diagnostics.Debugger");
-    if( types.size() == 1 )
+    const QList<quint32> ids = post(b);
+    if( ids.size() != b.size() )
     {
-        QList<quint32> meths = getMethods(types.first(),"Break");
-        if( meths.size() == 1 )
-            d_breakMeth = meths.first();
+        QList<Reply> res;
+        for( int i = 0; i < b.size(); i++ )
+            res << Reply();
+        return res;
     }
-#endif
+    return takeAll(ids);
 }
 
-void Debugger::processMessage(const QByteArray& payload)
+void Debugger::Batch::add(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
 {
-    switch( d_cmdSet )
-    {
-    case 0: // reply
-        //qDebug() << "reply received id =" << d_id << "err = " << d_err;
-        d_replies.insert( d_id, qMakePair(d_err,payload) );
-        break;
-    case 64: // Events
-        processEvent(d_cmd, payload);
-        break;
-    default:
-        error( tr("invalid command set %1 received from mono").arg(d_cmdSet));
-        break;
-    }
+    const int off = d_buf.size();
+    d_buf.resize( off + 11 + payload.size() );
+    char* p = d_buf.data() + off;
+    writeHeader( p, 11 + payload.size(), 0, cmdSet, cmd );
+    ::memcpy( p + 11, payload.constData(), payload.size() );
+    d_offs << off;
 }
 
-int Debugger::processEvent( quint8 evt, const QByteArray& payload)
+void Debugger::Batch::clear()
 {
-    int off = 0;
-    try
-    {
-        DebuggerEvent e;
-        e.event = evt;
-        e.object = 0;
-        e.offset = 0;
-        //qDebug() << "event" << e.event << "arrived with payload len" << payload.size();
-        if( evt != CMD_COMPOSITE )
-            off += readUint32(payload,off,e.thread);
-        switch( evt )
-        {
-        case DebuggerEvent::VM_START:
-            {
-                const quint32 domainId = readUint32( payload.constData() + 4 );
-                e.object = domainId;
-                d_domain = domainId;
-                onInitialSetup(true);
-            }
-            break;
-        case DebuggerEvent::VM_DEATH:
-            {
-                quint32 exitCode;
-                if( off < payload.size() )
-                {
-                    off += readUint32( payload, off, exitCode );
-                    e.exitCode = exitCode;
-                }else
-                    e.exitCode = 0;
-            }
-            break;
-        case DebuggerEvent::THREAD_START:
-        case DebuggerEvent::THREAD_DEATH:
-            e.object = e.thread;
-            break;
-        case DebuggerEvent::APPDOMAIN_CREATE:
-        case DebuggerEvent::APPDOMAIN_UNLOAD:
-            {
-                quint32 domainId;
-                off += readUint32( payload, off, domainId );
-                e.object = domainId;
-            }
-            break;
-        case DebuggerEvent::METHOD_ENTRY:
-        case DebuggerEvent::METHOD_EXIT:
-            {
-                quint32 methodId;
-                off += readUint32( payload, off, methodId );
-                e.object = methodId;
-            }
-            break;
-        case DebuggerEvent::ASSEMBLY_LOAD:
-        case DebuggerEvent::ASSEMBLY_UNLOAD:
-            {
-                quint32 assemblyId;
-                off += readUint32( payload, off, assemblyId );
-                e.object = assemblyId;
-            }
-            break;
-        case DebuggerEvent::BREAKPOINT:
-        case DebuggerEvent::STEP:
-            {
-                quint32 methodId;
-                off += readUint32( payload, off, methodId );
-                e.object = methodId;
-                quint64 il_offset;
-                off += readUint64( payload, off, il_offset );
-                if( il_offset > std::numeric_limits<quint32>::max() )
-                {
-                    e.offset = 0;
-#if 0
-                    // this value is not used anyway and on macOS 0xffffffffff is returned by Mono3
-                    e.offset = std::numeric_limits<quint32>::max();
-                    qWarning() << "value exceeds maximum offset" << il_offset;
-#endif
-                }else
-                    e.offset = il_offset;
-            }
-            break;
-        case DebuggerEvent::TYPE_LOAD:
-            {
-                quint32 typeId;
-                off += readUint32( payload, off, typeId );
-                e.object = typeId;
-            }
-            break;
-        case DebuggerEvent::EXCEPTION:
-            {
-                quint32 objectId;
-                off += readUint32( payload, off, objectId );
-                e.object = objectId;
-            }
-            break;
-        case DebuggerEvent::KEEPALIVE:
-            // suspend_policy = SUSPEND_POLICY_NONE;
-            break;
-        case DebuggerEvent::USER_BREAK:
-            break;
-        case DebuggerEvent::USER_LOG:
-            {
-                quint32 level;
-                off += readUint32( payload, off, level );
-                e.level = level;
-                QByteArray category;
-                off += readString( payload, off, category );
-                QByteArray message;
-                off += readString( payload, off, message );
-                e.msg = category + "\n" + message;
-            }
-            break;
-        case CMD_COMPOSITE:
-            {
-                if( payload.size() < 5 )
-                {
-                    error(tr("invalid composite event") );
-                    return 0;
-                }
-                const quint8 policy = (quint8)payload[0];
-                const quint32 count = readUint32(payload.constData() + 1 );
-                int off = 5;
-                for( int i = 0; i < count; i++ )
-                {
-                    if( off >= payload.size() )
-                        throw 0;
-                    const quint8 event = (quint8)payload[off++];
-                    quint32 id;
-                    off += readUint32( payload, off, id );
-                    off += processEvent(event,payload.mid(off));
-                }
-            }
-            break;
-        default:
-            error( tr("invalid event %1 %2").arg(evt).arg(payload.toHex().constData()) );
-            break;
-        }
-        if( evt != CMD_COMPOSITE )
-            emit sigEvent(e);
-    }catch(...)
-    {
-        error( tr("not enough data available") );
-    }
-    return off;
+    d_buf.clear();
+    d_offs.clear();
 }
 
-quint32 Debugger::sendRequest(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
+QPair<int, int> Debugger::vmGetVersion()
 {
-    if( d_sock == 0 )
-        return 0;
-    QByteArray header(11,0);
-    const quint32 id = d_id++;
-    writeUint32( header.data(), 11 + payload.size() );
-    writeUint32( header.data() + 4, id );
-    header[9] = cmdSet;
-    header[10] = cmd;
-    d_sock->write( header + payload );
-    //qDebug() << "request sent id =" << id << "cmd_set =" << cmdSet << "cmd =" << cmd;
-    return id;
+    Codec::Version res;
+    if( !call<Codec::VmVersion>(Codec::None(), res) ) // reports malformed replies
+        return QPair<int, int>();
+    return qMakePair(int(res.major), int(res.minor));
 }
 
-bool Debugger::error(const QString& msg)
+Debugger::Reply Debugger::fetchReply(quint32 id)
 {
-    d_status = ProtocolError;
-    if( d_sock )
-        d_sock->close();
-    qCritical() << msg;
-    emit sigError(msg);
-    return false;
+    Slot& slot = d_slots[ id & ( s_slotCount - 1 ) ];
+    if( slot.d_id != id || slot.d_state != SlotReady )
+        return Reply();
+    Reply res;
+    res.d_valid = true;
+    res.d_err = slot.d_err;
+    if( res.d_err != 0 )
+        qCritical() << "reply id" << id << "error" << res.d_err << toString(res.d_err);
+    res.d_data = slot.d_data;
+    const qint64 now = d_clock.nsecsElapsed();
+    const qint64 wake = now - slot.d_arrived;
+    const qint64 rtt = now - slot.d_sent;
+    CommandStats& cs = cmdStats( slot.d_cmdSet, slot.d_cmd );
+    if( res.d_err != 0 )
+        cs.errors[res.d_err]++;
+    if( cs.minLatency == 0 || rtt < cs.minLatency )
+        cs.minLatency = rtt;
+    if( rtt > cs.maxLatency )
+        cs.maxLatency = rtt;
+    cs.sumLatency += rtt;
+    int bucket = 0;
+    for( qint64 usecs = rtt / 1000; usecs > 0 && bucket < LatencyBuckets - 1; usecs >>= 1 )
+        bucket++;
+    cs.latency[bucket]++;
+    slot = Slot();
+    if( d_waitStats.count == 0 || wake < d_waitStats.minWake )
+        d_waitStats.minWake = wake;
+    if( wake > d_waitStats.maxWake )
+        d_waitStats.maxWake = wake;
+    d_waitStats.sumWake += wake;
+    if( d_waitStats.count == 0 || rtt < d_waitStats.minRtt )
+        d_waitStats.minRtt = rtt;
+    if( rtt > d_waitStats.maxRtt )
+        d_waitStats.maxRtt = rtt;
+    d_waitStats.sumRtt += rtt;
+    d_waitStats.count++;
+    return res;
 }
 
-Debugger::Reply Debugger::waitForId(quint32 id)
+Debugger::CommandStats::CommandStats(quint8 s, quint8 c):cmdSet(s),cmd(c),requests(0),replies(0),timeouts(0),
+    requestBytes(0),replyBytes(0),minLatency(0),maxLatency(0),sumLatency(0)
 {
-    const QDateTime start = QDateTime::currentDateTime();
-    while( d_sock )
-    {
-        Reply res = fetchReply(id);
-        if( res.d_valid )
-            return res;
-        if( start.secsTo(QDateTime::currentDateTime()) > 20 )
-        {
-            res.d_timeout = true;
-            return res;
-        }
-        d_sock->waitForReadyRead(1000);
-        onData();
-    }
-    return Reply();
+    ::memset( latency, 0, sizeof(latency) );
 }
 
-Debugger::Reply Debugger::sendReceive(quint8 cmdSet, quint8 cmd, const QByteArray& payload)
+QList<Debugger::CommandStats> Debugger::getCommandStats() const
 {
-    const quint32 id = sendRequest( cmdSet, cmd, payload);
-    Reply rep = waitForId(id);
-    if( rep.d_timeout )
-    {
-        error(tr("timeout in request %1.%2").arg(cmdSet).arg(cmd) );
-        return rep;
-    }else
-        return rep;
+    return d_cmdStats.values();
 }
 
-QPair<int, int> Debugger::vmGetVersion()
+Debugger::CommandStats Debugger::getCommandStats(quint8 cmdSet, quint8 cmd) const
 {
-    QPair<int, int> res;
-
-    Reply rep = sendReceive(CMD_SET_VM,CMD_VM_VERSION);
-    if( !rep.isOk() )
-        return res;
-    try
-    {
-        int off = 0;
-        QByteArray str;
-        off += readString(rep.d_data, off, str);
-        quint32 tmp;
-        off += readUint32( rep.d_data, off, tmp );
-        res.first = tmp;
-        off += readUint32( rep.d_data, off, tmp );
-        res.second = tmp;
-    }catch(...)
-    {
-        error(tr("not enough data received in vmGetVersion") );
-    }
-    return res;
+    return d_cmdStats.value( ( cmdSet << 8 ) | cmd, CommandStats(cmdSet,cmd) );
 }
 
-Debugger::Reply Debugger::fetchReply(quint32 id)
+QByteArray Debugger::commandStatsToJson() const
 {
-    Replies::iterator i = d_replies.find(id);
-    if( i != d_replies.end() )
+    QJsonArray cmds;
+    QMap<quint16,CommandStats>::const_iterator i;
+    for( i = d_cmdStats.begin(); i != d_cmdStats.end(); ++i )
     {
-        Reply res;
-        res.d_valid = true;
-        res.d_err = i.value().first;
-        if( res.d_err != 0 )
-            qCritical() << "reply id" << id << "error" << res.d_err << toString(res.d_err);
-        res.d_data = i.value().second;
-        d_replies.erase(i);
-        return res;
-    }else
-        return Reply();
+        const CommandStats& cs = i.value();
+        QJsonObject obj;
+        obj.insert( "cmdSet", cs.cmdSet );
+        obj.insert( "cmd", cs.cmd );
+        obj.insert( "requests", qint64(cs.requests) );
+        obj.insert( "replies", qint64(cs.replies) );
+        obj.insert( "timeouts", qint64(cs.timeouts) );
+        obj.insert( "requestBytes", qint64(cs.requestBytes) );
+        obj.insert( "replyBytes", qint64(cs.replyBytes) );
+        quint32 taken = 0;
+        QJsonArray hist;
+        int last = LatencyBuckets;
+        while( last > 0 && cs.latency[last-1] == 0 )
+            last--;
+        for( int b = 0; b < last; b++ )
+        {
+            hist.append( qint64(cs.latency[b]) );
+            taken += cs.latency[b];
+        }
+        obj.insert( "minUsecs", double(cs.minLatency) / 1000.0 );
+        obj.insert( "maxUsecs", double(cs.maxLatency) / 1000.0 );
+        obj.insert( "avgUsecs", taken ? double(cs.sumLatency) / 1000.0 / taken : 0.0 );
+        obj.insert( "latencyLog2Usecs", hist );
+        QJsonObject errs;
+        QHash<quint8,quint32>::const_iterator j;
+        for( j = cs.errors.begin(); j != cs.errors.end(); ++j )
+            errs.insert( toString(j.key()), qint64(j.value()) );
+        obj.insert( "errors", errs );
+        cmds.append( obj );
+    }
+    return QJsonDocument(cmds).toJson();
 }
 
 Debugger::MethodDbgInfo::Loc Debugger::MethodDbgInfo::find(quint32 iloff) const
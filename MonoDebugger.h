@@ -23,13 +23,20 @@
 #include <QObject>
 #include <QAbstractSocket>
 #include <QHash>
+#include <QCache>
+#include <QMap>
+#include <QVector>
 #include <QVariant>
+#include <QElapsedTimer>
 
 class QTcpServer;
 class QTcpSocket;
+class QFile;
 
 namespace Mono
 {
+    class ValueBuffer;
+
     struct DebuggerEvent
     {
         enum EventKind { VM_START = 0, VM_DEATH, THREAD_START, THREAD_DEATH, APPDOMAIN_CREATE, APPDOMAIN_UNLOAD,
@@ -38,6 +45,7 @@ namespace Mono
         static const char* s_event[];
 
         quint8 event;
+        quint32 request; // id of the event request which caused the event, or 0
         quint32 thread;
         quint32 object;
         union
@@ -71,7 +79,39 @@ namespace Mono
 
         bool addBreakpoint(quint32 methodId, quint32 iloffset ); // method-id cannot be zero in Mono3
         bool removeBreakpoint(quint32 methodId, quint32 iloffset );
-        bool clearAllBreakpoints();
+        bool clearAllBreakpoints(); // including the tracepoints
+
+        // A tracepoint records a message on every hit instead of stopping; the VM is not suspended if no values
+        // are captured, otherwise the whole VM until the values are fetched.
+        struct Tracepoint
+        {
+            QByteArray message; // %1, %2 etc. are replaced by the captured values in the order below
+            QList<quint16> params; // 0 is the first parameter after this
+            QList<quint16> locals;
+            QList<quint32> fields; // of this
+        };
+        quint32 addTracepoint(quint32 methodId, quint32 iloffset, const Tracepoint& ); // request id or 0
+        bool removeTracepoint(quint32 requestId);
+        struct TraceRecord
+        {
+            qint64 time; // usecs since the Debugger was created
+            quint32 request, thread, hit;
+            QByteArray message;
+            QVariantList values;
+        };
+        QList<TraceRecord> takeTraceRecords(); // all buffered records, oldest first
+        void setTraceBufferSize(int records); // the oldest records are dropped if full
+        quint32 getDroppedTraceRecords() const { return d_traceDropped; }
+
+        struct EventRequest
+        {
+            quint32 id; // 0 if unknown
+            quint8 kind; // DebuggerEvent::EventKind
+            quint32 method, iloffset; // BREAKPOINT only
+            quint32 hits; // number of events caused by this request so far
+            EventRequest(quint32 i = 0, quint8 k = 0, quint32 m = 0, quint32 o = 0):id(i),kind(k),method(m),iloffset(o),hits(0){}
+        };
+        EventRequest getEventRequest(quint32 requestId) const; // see DebuggerEvent::request
 
         QList<quint32> allThreads();
         QByteArray getThreadName(quint32 threadId);
@@ -93,12 +133,65 @@ namespace Mono
             quint32 il_offset;
             quint8 flags;
         };
-        QList<Frame> getStack(quint32 threadId);
+        QList<Frame> getStack(quint32 threadId, quint32 start = 0, qint32 len = -1 ); // len -1 means all
+        struct ThreadInfo
+        {
+            quint32 id;
+            QByteArray name;
+            ThreadState state;
+            bool threadPool;
+            quint64 tid; // of the operating system
+            QList<Frame> top; // at most topFrames, the innermost first
+            ThreadInfo():id(0),state(Invalid),threadPool(false),tid(0){}
+        };
+        QList<ThreadInfo> getThreadSnapshot(int topFrames = 0); // all threads with one round of requests
         QVariantList getParamValues(quint32 threadId, quint32 frameId, bool hasThis, quint16 numOfParams );
         QVariantList getLocalValues(quint32 threadId, quint32 frameId, quint16 numOfLocals );
-        QString getString(quint32 strId);
-        quint32 getArrayLength(quint32 arrId);
+        // the ValueBuffer variants return false if a value is invalid; see ValueBuffer::read
+        bool getLocalValues(quint32 threadId, quint32 frameId, quint16 numOfLocals, ValueBuffer& );
+        struct Variable
+        {
+            QByteArray name;
+            quint32 type; // declared type id, or 0 if not known
+            QVariant value;
+            Variable():type(0){}
+        };
+        struct FrameSnapshot
+        {
+            bool valid;
+            bool hasThis; // i.e. not a static method
+            Variable self;
+            QList<Variable> params, locals;
+            FrameSnapshot():valid(false),hasThis(false){}
+        };
+        FrameSnapshot getFrameSnapshot(quint32 threadId, const Frame& ); // this, params and locals with names
+        QString getString(quint32 strId); // cached, least recently used strings are evicted
+        qint64 getStringLength(quint32 strId); // in UTF-16 code units, -1 on error
+        QString getStringChars(quint32 strId, qint64 start, int count ); // without transferring the whole string
+        QString getString(quint32 strId, int maxLen, bool* truncated = 0 ); // the first maxLen chars at most
+        void setStringCacheSize(int bytes);
+        quint32 getArrayLength(quint32 arrId); // of the first dimension
         QVariantList getArrayValues(quint32 arrId, quint32 len );
+        struct ArrayBounds
+        {
+            QList<quint32> lengths; // per dimension
+            QList<qint32> lowerBounds;
+            int rank() const { return lengths.size(); }
+            quint32 count() const; // of all dimensions; 0 if more than the protocol can address
+            qint32 indexOf( const QList<qint32>& index ) const; // row-major like the agent; -1 if out of bounds
+        };
+        ArrayBounds getArrayBounds(quint32 arrId);
+        // elements [start, start + count) of all dimensions in row-major order; only the pages not yet fetched
+        // in this epoch are requested, all with one batch
+        QVariantList getArrayValues(quint32 arrId, quint32 start, quint32 count );
+        bool getArrayValues(quint32 arrId, quint32 start, quint32 count, ValueBuffer& );
+        enum { ArrayPageSize = 256 }; // elements per GET_VALUES request
+        // the same for arrays of primitives without a QVariant per element; empty if the element type does not match
+        QVector<qint32> getArrayI32(quint32 arrId, quint32 start, quint32 count ); // int and uint
+        QVector<qint64> getArrayI64(quint32 arrId, quint32 start, quint32 count ); // long and ulong
+        QVector<float> getArrayR32(quint32 arrId, quint32 start, quint32 count );
+        QVector<double> getArrayR64(quint32 arrId, quint32 start, quint32 count );
+        QByteArray getArrayU8(quint32 arrId, quint32 start, quint32 count ); // byte and sbyte
 
         struct MethodDbgInfo
         {
@@ -115,6 +208,7 @@ namespace Mono
         };
         MethodDbgInfo getMethodInfo(quint32 methodId);
         QByteArray getMethodName(quint32 methodId);
+        QByteArrayList getMethodNames(const QList<quint32>& methodIds); // one socket write for all
         quint32 getMethodOwner(quint32 methodId); // returns typeId or 0
         QByteArray getMethodBody(quint32 methodId);
         QPair<quint32,quint32> getMethodFlags(quint32 methodId);
@@ -137,6 +231,15 @@ namespace Mono
             QByteArray spaceName() const;
         };
         TypeInfo getTypeInfo(quint32 typeId);
+        struct SymbolFrame
+        {
+            Frame frame;
+            QByteArray name; // of the method
+            TypeInfo type; // declaring the method
+            QByteArray sourceFile;
+            MethodDbgInfo::Loc loc; // of frame.il_offset
+        };
+        QList<SymbolFrame> getSymbolicatedStack(quint32 threadId); // with pipelined metadata lookups
         quint32 getTypeObject(quint32 typeId);
         QList<quint32> getMethods(quint32 typeId, const QByteArray& name = QByteArray());
         quint32 getObjectType(quint32 objId);
@@ -146,13 +249,106 @@ namespace Mono
             QByteArray name;
         };
         QList<FieldInfo> getFields(quint32 typeId, bool instanceLevel = true, bool classLevel = true);
-        QVariantList getValues(quint32 objectOrTypeId, const QList<quint32>& fieldIds, bool typeLevel = false);
+        QVariantList getValues(quint32 objectOrTypeId, const QList<quint32>& fieldIds, bool typeLevel = false,
+                               quint32 threadId = 0 ); // threadId only for thread static fields
+        bool getValues(quint32 objectOrTypeId, const QList<quint32>& fieldIds, ValueBuffer&, bool typeLevel = false,
+                               quint32 threadId = 0 );
 
         QByteArray getAssemblyName(quint32 assemblyId);
+        // the answers of the method, type and assembly queries above are cached until the assembly is unloaded
+        void clearMetadataCache();
+        // with a cache directory, method names, debug info and param and local names are also kept on disk
+        // per assembly, keyed by module GUID and file content, and reused by later sessions; the store of an
+        // assembly is opened with the first metadata lookup which needs it
+        void setCacheDir( const QString& path );
+        void saveCaches(); // also done on disconnect and assembly unload
+        // getStack, getParamValues, getLocalValues, getArrayValues and getValues are cached until the epoch
+        // changes, i.e. until the VM is resumed, stepped, invokes a method, a value is set or an event arrives
+        quint32 getEpoch() const { return d_epoch; }
+        QPair<int,int> getVmVersion() const { return d_vmVersion; } // known after VM_START
+        // optional agent features, tried once and then remembered for the connection
+        enum Feature { MethodsByNameFlags = 1, // known after the first getMethods with a name
+                       FrameRange = 2 // known after the first partial getStack
+                     };
+        bool hasFeature( Feature f ) const { return d_features & f; }
+
+        struct Reply
+        {
+            quint8 d_err;
+            bool d_timeout;
+            bool d_valid;
+            QByteArray d_data;
+            Reply():d_err(0),d_timeout(false),d_valid(false){}
+            bool isOk() const { return d_valid && d_err == 0; }
+        };
+        // non-blocking requests; any number of them can be in flight at the same time;
+        // post() returns the request id (0 on error) which is signalled by sigReply when the reply arrives
+        quint32 post( quint8 cmdSet, quint8 cmd, const QByteArray& payload = QByteArray() );
+        bool isReady( quint32 id ) const;
+        Reply take( quint32 id ); // waits if the reply is not yet available
+        QList<Reply> takeAll( const QList<quint32>& ids );
+
+        class Batch
+        {
+        public:
+            void add( quint8 cmdSet, quint8 cmd, const QByteArray& payload = QByteArray() );
+            int size() const { return d_offs.size(); }
+            bool isEmpty() const { return d_offs.isEmpty(); }
+            void clear();
+        private:
+            friend class Debugger;
+            QByteArray d_buf; // all encoded packets; the ids are filled in by post()
+            QList<int> d_offs; // start of each packet in d_buf
+        };
+        QList<quint32> post( Batch& ); // writes all requests of the batch at once
+        QList<Reply> execute( Batch& ); // replies in the order of Batch::add; large batches are sent in parts
+
+        void setTimeout( quint8 cmdSet, int msecs ); // deadline for replies to commands of this set
+        int getTimeout( quint8 cmdSet ) const;
+        struct WaitStats
+        {
+            quint32 count; // number of replies taken
+            // nsecs from the socket read which completed the reply to the return of the waiter
+            qint64 minWake, maxWake, sumWake;
+            qint64 minRtt, maxRtt, sumRtt; // nsecs from sending the request to the return of the waiter
+            quint32 late; // replies dropped because their waiter had timed out
+            quint32 orphans; // replies dropped because no request was waiting for them
+            quint32 reclaimed; // requests never taken whose slot was needed for a newer request
+            WaitStats():count(0),minWake(0),maxWake(0),sumWake(0),minRtt(0),maxRtt(0),sumRtt(0),
+                late(0),orphans(0),reclaimed(0){}
+        };
+        WaitStats getWaitStats() const { return d_waitStats; }
+        void resetWaitStats() { d_waitStats = WaitStats(); }
+        enum { LatencyBuckets = 24 };
+        struct CommandStats
+        {
+            quint8 cmdSet, cmd;
+            quint32 requests, replies, timeouts;
+            quint64 requestBytes, replyBytes; // including the packet headers
+            qint64 minLatency, maxLatency, sumLatency; // nsecs from sendRequest() to fetchReply()
+            quint32 latency[LatencyBuckets]; // bucket i counts latencies below 2^i usecs, the last one the rest
+            QHash<quint8,quint32> errors; // error code -> number of replies
+            CommandStats(quint8 s = 0, quint8 c = 0);
+        };
+        QList<CommandStats> getCommandStats() const; // ordered by cmdSet and cmd
+        CommandStats getCommandStats( quint8 cmdSet, quint8 cmd ) const;
+        void resetCommandStats() { d_cmdStats.clear(); }
+        QByteArray commandStatsToJson() const;
+
+        // the log starts with "MDWPLOG1" followed by one entry per packet: usecs since the previous entry (4),
+        // kind (1: request, reply, event), cmdSet (1), cmd (1), err (1), id (4), payload length (4), payload;
+        // numbers are big endian like on the wire; replies carry the cmdSet and cmd of their request
+        bool record( const QString& path ); // log all packets sent and received until stopRecording()
+        void stopRecording();
+        bool isRecording() const { return d_log != 0; }
+        bool replay( const QString& path ); // feeds the received packets of a log through the parser; no socket
 
     signals:
         void sigError( const QString& );
         void sigEvent( const DebuggerEvent& );
+        void sigEvents( const QVector<DebuggerEvent>& ); // all events of a packet at once
+        void sigReply( quint32 id );
+        void sigTraceRecords(); // new records are available by takeTraceRecords()
     protected slots:
         void onNewConnection();
         void onError(QAbstractSocket::SocketError);
@@ -160,22 +356,37 @@ namespace Mono
         void onData();
         void onInitialSetup(bool);
     protected:
+        void readPackets();
+        void parsePackets();
         void processMessage( const QByteArray& payload = QByteArray() );
-        int processEvent( quint8 evt, const QByteArray& );
+        void processEvent( quint8 evt, const QByteArray& );
+        bool decodeEvent( const QByteArray&, int& off, DebuggerEvent& );
+        void dispatchEvent( DebuggerEvent& );
         bool checkLen( const QByteArray& buf, int off, int len );
         quint32 sendRequest( quint8 cmdSet, quint8 cmd, const QByteArray& payload = QByteArray() );
         bool error(const QString&);
-        struct Reply
-        {
-            quint8 d_err;
-            bool d_timeout;
-            bool d_valid;
-            QByteArray d_data;
-            Reply():d_err(0),d_timeout(false),d_valid(false){}
-            bool isOk() const { return d_valid && d_err == 0; }
-        };
+        quint32 nextId();
+        void addPending(quint32 id, quint8 cmdSet, quint8 cmd, quint32 bytes);
+        CommandStats& cmdStats(quint8 cmdSet, quint8 cmd); // created if missing
+        void resetSlots();
         Reply waitForId(quint32 id);
         Reply sendReceive(quint8 cmdSet, quint8 cmd, const QByteArray& payload = QByteArray());
+        template<class Command> // see MonoDebuggerCodec.h
+        bool call(const typename Command::Request&, typename Command::Reply&);
+        template<class Command>
+        bool decode(const Reply&, typename Command::Reply&); // false if not ok; reports malformed replies
+        template<class Command>
+        Reply epochCall(const typename Command::Request&);
+        quint32 sendPacket(quint8 cmdSet, quint8 cmd, QByteArray& packet); // the header is written in place
+        Reply cachedReceive(quint8 cmdSet, quint8 cmd, quint32 id); // metadata request with one id
+        template<class Command>
+        bool cachedCall(quint32 id, typename Command::Reply&); // empty reply if not ok or malformed
+        typedef QPair<quint16,QByteArray> EpochKey; // cmdSet << 8 | cmd, request payload
+        bool fromEpochCache(const EpochKey&, Reply&);
+        void toEpochCache(const EpochKey&, const Reply&);
+        Reply epochReceive(quint8 cmdSet, quint8 cmd, const QByteArray& payload);
+        bool getArrayPages(quint32 arrId, quint32& start, quint32& count, QList<QByteArray>& pages);
+        void invalidateMetadata(quint32 assembly);
         QPair<int,int> vmGetVersion();
         enum RunMode { FreeRun, StepIn, StepOver, StepOut };
         bool step(quint32 threadId, RunMode, bool lineStep);
@@ -183,23 +394,92 @@ namespace Mono
         void enableExceptionBreaks();
     private:
         Reply fetchReply(quint32 id);
+        void copyFromRing(quint64 pos, char* to, quint32 len) const;
+        void releaseRing();
+        void growRing(quint32 size);
+        void appendToRing(const char* data, quint32 len);
+        void logPacket(quint8 kind, quint32 id, quint8 cmdSet, quint8 cmd, quint8 err, const char* data, quint32 len);
     private:
         QTcpServer* d_srv;
         QTcpSocket* d_sock;
-        enum Status { WaitHandshake, WaitHeader, WaitData, ProtocolError };
+        QByteArray d_packet; // reused by call()
+        enum Status { WaitHandshake, WaitHeader, ProtocolError };
         int d_status;
         quint32 d_len;
-        quint32 d_id;
+        quint32 d_id; // of the received packet
+        quint32 d_nextId; // of the next request sent
         quint8 d_cmdSet, d_cmd, d_err; // if d_cmdSet == 0 then this is a reply
-        typedef QPair<quint8,QByteArray> Packet;
-        typedef QHash<quint32,Packet> Replies;
-        Replies d_replies; // id -> result_code,
+        enum SlotState { SlotFree, SlotPending, SlotReady, SlotAbandoned };
+        struct Slot
+        {
+            quint32 d_id; // the request currently owning the slot
+            quint8 d_state;
+            quint8 d_cmdSet, d_cmd, d_err;
+            qint64 d_sent, d_arrived; // nsecs on d_clock; arrived is when the last bytes were read
+            qint64 d_deadline; // msecs on d_clock
+            QByteArray d_data;
+            Slot():d_id(0),d_state(SlotFree),d_cmdSet(0),d_cmd(0),d_err(0),d_sent(0),d_arrived(0),d_deadline(0){}
+        };
+        QVector<Slot> d_slots; // reply of request id is in d_slots[id % size]
+        QList< QPair<quint8,QByteArray> > d_deferred; // events received while waiting for a reply
+        QHash<quint8,int> d_timeouts; // cmdSet -> msecs
+        QElapsedTimer d_clock;
+        WaitStats d_waitStats;
+        QMap<quint16,CommandStats> d_cmdStats; // cmdSet << 8 | cmd
+        int d_waiting;
+        QByteArray d_ring; // receive buffer; the size is a power of two
+        QList<QByteArray> d_retired; // replaced rings still referenced by payload views
+        quint64 d_rd, d_rel, d_wr; // ring positions: next packet, first byte in use, next byte to be filled
+        qint64 d_readAt; // nsecs on d_clock of the last read from the socket
+        int d_views; // number of payload views into d_ring being processed
+        QFile* d_log;
+        qint64 d_logTime; // nsecs on d_clock of the last entry
         RunMode d_mode;
         bool d_lineStep;
         quint32 d_modeReq;
         quint32 d_breakMeth;
         quint32 d_domain;
         QHash<QPair<quint32,quint32>,quint32> d_breakPoints; // meth,iloff->reqid
+        QHash<quint32,EventRequest> d_requests; // reqid -> owner of the request
+        QHash<quint32,Tracepoint> d_tracepoints; // reqid ->
+        QList<TraceRecord> d_traceRecords;
+        int d_traceBufferSize;
+        quint32 d_traceDropped;
+        bool captureTrace(const DebuggerEvent&, const Tracepoint&);
+        QPair<int,int> d_vmVersion; // major, minor; as reported by the VM
+        quint32 d_features, d_probed; // Feature flags
+        typedef QPair<quint16,quint32> MetaKey; // cmdSet << 8 | cmd, id
+        QHash<MetaKey,QByteArray> d_meta; // replies of metadata requests
+        QHash<quint32,quint32> d_typeAssembly; // typeId -> assemblyId
+        QHash<quint32,quint32> d_methodType; // methodId -> typeId
+        struct MetaStore
+        {
+            QString path; // empty if the assembly cannot be cached
+            QByteArray hash; // of the module file; empty if the file is not accessible
+            QHash<quint64,QByteArray> replies; // cmd << 32 | method token -> reply
+            bool dirty;
+            MetaStore():dirty(false){}
+        };
+        QHash<quint32,MetaStore> d_stores; // assemblyId ->
+        QString d_cacheDir;
+        MetaStore* getStore(quint32 assemblyId);
+        MetaStore* methodStore(quint32 methodId, quint32& token, bool fetch);
+        bool fromStore(quint8 cmd, quint32 methodId, QByteArray& reply, bool fetch);
+        bool isPersistent(quint8 cmdSet, quint8 cmd) const;
+        void rememberMetadata(const MetaKey&, const QByteArray& reply);
+        void addMetadataRequests(Batch&, QList<MetaKey>&, quint8 cmdSet, quint8 cmd, const QList<quint32>& ids);
+        void executeMetadata(Batch&, QList<MetaKey>&);
+        void saveStore(MetaStore&);
+        static bool hasTypeIds(quint8 cmd);
+        static bool isValidRecord(quint64 key, const QByteArray& reply);
+        QHash<EpochKey,QByteArray> d_epochCache; // replies of frame and value requests in d_cacheEpoch
+        quint32 d_epoch, d_cacheEpoch;
+        struct CachedString
+        {
+            QString str;
+            quint32 epoch; // in which the id was known to be alive
+        };
+        QCache<quint32,CachedString> d_strings; // strId ->, cost in bytes
     };
 
     // possible results of Debugger::getValues:
@@ -222,6 +502,49 @@ namespace Mono
         quint32 cls;
         QVariantList fields;
     };
+
+    // Values as received, in one contiguous buffer of 16 byte slots instead of a QVariant per value;
+    // the fields of a struct are in the consecutive slots from Slot::first() on.
+    class ValueBuffer
+    {
+    public:
+        enum Kind { Null, Bool, Char, I1, U1, I2, U2, I4, U4, I8, U8, R4, R8, Ptr, IntPtr, UIntPtr,
+                    Ref, // sub is the ObjectRef type, id the object
+                    Struct, // sub is 1 for enums, id is the class
+                    ParentVType,
+                    Invalid // malformed or unsupported, or after such a value; toVariant() is null
+                  };
+        struct Slot
+        {
+            quint8 kind;
+            quint8 sub;
+            quint16 reserved;
+            quint32 id;
+            quint64 bits; // integers sign or zero extended, reals as is; Struct: count << 32 | first
+            quint32 first() const { return bits & 0xffffffff; }
+            quint32 count() const { return bits >> 32; }
+            qint64 toInt() const { return bits; }
+            double toReal() const;
+        };
+        int size() const { return d_roots.size(); }
+        const Slot& value(int i) const { return d_slots[d_roots[i]]; }
+        const Slot& slot(quint32 s) const { return d_slots[s]; } // e.g. the fields of a Struct
+        QVariant toVariant(int i) const; // as the QVariant based API returns it
+        QVariantList toVariantList() const;
+        int memory() const; // bytes used by the slots
+        void clear();
+
+        // appends count values after skipping skipped ones; returns the bytes used, or -1 if a value is invalid,
+        // in which case it and all values after it are appended as Invalid
+        int read(const QByteArray& data, int off, int count, int skipped = 0);
+        void appendInvalid(int count);
+        static int skip(const QByteArray& data, int off); // the size of the value at off, or -1 if invalid
+    private:
+        int readSlot(const QByteArray& data, int off, int s);
+        QVariant toVariant(const Slot&) const;
+        QVector<Slot> d_slots;
+        QVector<int> d_roots;
+    };
 }
 
 Q_DECLARE_METATYPE(Mono::ObjectRef)
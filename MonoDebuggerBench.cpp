@@ -0,0 +1,365 @@
+/*
+* Copyright 2021 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MonoTools library.
+*
+* The following is the license that applies to this copy of the
+* library. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MonoDebugger.h"
+#include "MonoFakeAgent.h"
+#include "MonoDebuggerPrivate.h"
+#include <QCoreApplication>
+#include <QThread>
+#include <QStringList>
+#include <QtDebug>
+#include <stdio.h>
+using namespace Mono;
+
+// Throughput and latency of the Debugger queries against a FakeAgent in another thread,
+// or parser throughput with a packet log recorded by Debugger::record().
+// usage: MonoDebuggerBench [latency msecs [iterations]]
+//        MonoDebuggerBench -replay log [iterations]
+
+class Bench : public QObject
+{
+    Q_OBJECT
+public:
+    Debugger* d_dbg;
+    FakeAgent* d_agent;
+    QThread* d_thread;
+    int d_iterations;
+    quint32 d_events;
+
+    Bench(int latency, int iterations):d_iterations(iterations),d_events(0)
+    {
+        d_dbg = new Debugger(this);
+        connect( d_dbg, SIGNAL(sigEvents(QVector<DebuggerEvent>)), this, SLOT(onEvents(QVector<DebuggerEvent>)) );
+        d_thread = new QThread(this);
+        d_agent = new FakeAgent();
+        d_agent->setLatency(latency);
+        d_agent->moveToThread(d_thread);
+        connect( d_thread, SIGNAL(finished()), d_agent, SLOT(deleteLater()) );
+        d_thread->start();
+    }
+    ~Bench()
+    {
+        d_thread->quit();
+        d_thread->wait();
+    }
+    bool start()
+    {
+        const quint16 port = d_dbg->open();
+        if( port == 0 )
+            return false;
+        QMetaObject::invokeMethod( d_agent, "connectTo", Qt::QueuedConnection, Q_ARG(quint16, port) );
+        QElapsedTimer t;
+        t.start();
+        // the initial setup done by the Debugger on VM_START is not part of the measurements
+        while( d_dbg->getVmVersion().first == 0 && t.elapsed() < 5000 )
+            QCoreApplication::processEvents();
+        return d_dbg->getVmVersion().first != 0;
+    }
+    void report( const char* name, int n, qint64 nsecs )
+    {
+        printf( "%-28s %8d %12.1f %12.2f\n", name, n, nsecs / 1000000.0, nsecs / 1000.0 / qMax(n,1) );
+        fflush(stdout);
+    }
+    void run();
+    void runWithoutFrameRanges();
+public slots:
+    void onEvents(const QVector<DebuggerEvent>& e)
+    {
+        d_events += e.size();
+    }
+};
+
+#define BENCH( name, expr ) \
+    { \
+        QElapsedTimer t; \
+        t.start(); \
+        for( int i = 0; i < d_iterations; i++ ) \
+            expr; \
+        report( name, d_iterations, t.nsecsElapsed() ); \
+    }
+
+void Bench::run()
+{
+    const FakeAgent::Sizes& sz = d_agent->getSizes();
+    const quint32 thread = 0x100;
+    const quint32 method = 0x2000;
+    const quint32 type = 0x3000;
+    const quint32 object = 0x5000;
+    QList<quint32> methods;
+    for( quint32 i = 0; i < sz.methods; i++ )
+        methods << method + i;
+    QList<quint32> fields;
+    for( quint32 i = 0; i < sz.fields; i++ )
+        fields << 0x4000 + i;
+
+    printf( "%-28s %8s %12s %12s\n", "query", "calls", "total ms", "us/call" );
+    BENCH( "allThreads", d_dbg->allThreads() );
+    BENCH( "getThreadName", d_dbg->getThreadName(thread) );
+    BENCH( "getThreadState", d_dbg->getThreadState(thread) );
+    BENCH( "thread list",
+    {
+        const QList<quint32> threads = d_dbg->allThreads();
+        for( int j = 0; j < threads.size(); j++ )
+        {
+            d_dbg->getThreadName(threads[j]);
+            d_dbg->getThreadState(threads[j]);
+        }
+    } );
+    BENCH( "getThreadSnapshot", d_dbg->getThreadSnapshot() );
+    BENCH( "getThreadSnapshot(1)", ( d_dbg->resume(), d_dbg->getThreadSnapshot(1) ) );
+    BENCH( "getCoreLib", d_dbg->getCoreLib(0x12) );
+    BENCH( "findType", d_dbg->findType("Fake.Type0") );
+    BENCH( "findType(assembly)", d_dbg->findType("Fake.Type0", 0x10) );
+    BENCH( "getTypesOf", d_dbg->getTypesOf("/tmp/Fake.obx") );
+    BENCH( "getStack", d_dbg->getStack(thread) );
+    BENCH( "getParamValues", d_dbg->getParamValues(thread, 1, true, sz.params) );
+    BENCH( "getLocalValues", d_dbg->getLocalValues(thread, 1, sz.locals) );
+    BENCH( "getLocalValues(cold)", ( d_dbg->resume(), d_dbg->getLocalValues(thread, 1, sz.locals) ) );
+    BENCH( "getLocalValues(buffer, cold)",
+    {
+        d_dbg->resume();
+        ValueBuffer b;
+        d_dbg->getLocalValues(thread, 1, sz.locals, b);
+    } );
+    BENCH( "getString", d_dbg->getString(0x6000) );
+    BENCH( "getString(preview)", ( d_dbg->resume(), d_dbg->getString(0x6000 + i, 16) ) );
+    BENCH( "getArrayLength", d_dbg->getArrayLength(object) );
+    BENCH( "getArrayValues", d_dbg->getArrayValues(object, sz.arrayLen) );
+    BENCH( "getArrayValues(window)", d_dbg->getArrayValues(object, sz.arrayLen / 2, 10) );
+    BENCH( "getArrayValues(window, cold)", ( d_dbg->resume(), d_dbg->getArrayValues(object, sz.arrayLen / 2, 10) ) );
+    BENCH( "getArrayValues(all, cold)", ( d_dbg->resume(), d_dbg->getArrayValues(object, 0, sz.arrayLen) ) );
+    BENCH( "getArrayI32(all, cold)", ( d_dbg->resume(), d_dbg->getArrayI32(object, 0, sz.arrayLen) ) );
+    BENCH( "getArrayValues(all)", d_dbg->getArrayValues(object, 0, sz.arrayLen) );
+    BENCH( "getArrayI32(all)", d_dbg->getArrayI32(object, 0, sz.arrayLen) );
+    BENCH( "getArrayValues(buffer)",
+    {
+        ValueBuffer b;
+        d_dbg->getArrayValues(object, 0, sz.arrayLen, b);
+    } );
+    BENCH( "getMethodInfo", d_dbg->getMethodInfo(method) );
+    BENCH( "getMethodName", d_dbg->getMethodName(method) );
+    BENCH( "getMethodOwner", d_dbg->getMethodOwner(method) );
+    BENCH( "getMethodBody", d_dbg->getMethodBody(method) );
+    BENCH( "getMethodFlags", d_dbg->getMethodFlags(method) );
+    BENCH( "isMethodStatic", d_dbg->isMethodStatic(method) );
+    BENCH( "getMethodKind", d_dbg->getMethodKind(method) );
+    BENCH( "getParamCount", d_dbg->getParamCount(method) );
+    BENCH( "getParamNames", d_dbg->getParamNames(method) );
+    BENCH( "getLocalsCount", d_dbg->getLocalsCount(method) );
+    BENCH( "getLocalNames", d_dbg->getLocalNames(method) );
+    BENCH( "getTypeInfo", d_dbg->getTypeInfo(type) );
+    BENCH( "getTypeObject", d_dbg->getTypeObject(type) );
+    BENCH( "getMethods", d_dbg->getMethods(type) );
+    BENCH( "getMethods(name)", d_dbg->getMethods(type, "method5") );
+    BENCH( "getObjectType", d_dbg->getObjectType(object) );
+    BENCH( "getFields", d_dbg->getFields(type) );
+    BENCH( "getValues", d_dbg->getValues(object, fields) );
+    BENCH( "getValues(type)", d_dbg->getValues(type, fields, true) );
+    BENCH( "getAssemblyName", d_dbg->getAssemblyName(0x10) );
+    BENCH( "add/removeBreakpoint", ( d_dbg->addBreakpoint(method, 4), d_dbg->removeBreakpoint(method, 4) ) );
+    BENCH( "suspend/resume", ( d_dbg->suspend(), d_dbg->resume() ) );
+
+    // many names, serially and with one batch
+    BENCH( "getMethodName x methods", for( int j = 0; j < methods.size(); j++ ) d_dbg->getMethodName(methods[j]) );
+    BENCH( "getMethodNames", d_dbg->getMethodNames(methods) );
+
+    // the call sequence of DebuggerGui::onGetStack, with and without the metadata cache
+    BENCH( "stack with symbols",
+    {
+        const QList<Debugger::Frame> stack = d_dbg->getStack(thread);
+        for( int j = 0; j < stack.size(); j++ )
+        {
+            d_dbg->getTypeInfo(d_dbg->getMethodOwner(stack[j].method));
+            d_dbg->getMethodInfo(stack[j].method);
+            d_dbg->getMethodName(stack[j].method);
+        }
+    } );
+    BENCH( "stack with symbols (cold)",
+    {
+        d_dbg->clearMetadataCache();
+        const QList<Debugger::Frame> stack = d_dbg->getStack(thread);
+        for( int j = 0; j < stack.size(); j++ )
+        {
+            d_dbg->getTypeInfo(d_dbg->getMethodOwner(stack[j].method));
+            d_dbg->getMethodInfo(stack[j].method);
+            d_dbg->getMethodName(stack[j].method);
+        }
+    } );
+
+    BENCH( "getSymbolicatedStack", d_dbg->getSymbolicatedStack(thread) );
+    BENCH( "getSymbolicatedStack (cold)", ( d_dbg->clearMetadataCache(), d_dbg->getSymbolicatedStack(thread) ) );
+
+    // the call sequence of DebuggerGui::onLocals before getFrameSnapshot, and with it; resume() starts a new
+    // epoch so that the values are fetched again
+    BENCH( "locals sequence",
+    {
+        d_dbg->resume();
+        const QList<Debugger::Frame> stack = d_dbg->getStack(thread);
+        const quint32 m = stack.first().method;
+        const bool isStatic = d_dbg->isMethodStatic(m);
+        const quint16 params = d_dbg->getParamCount(m);
+        const quint16 locals = d_dbg->getLocalsCount(m);
+        d_dbg->getParamNames(m);
+        d_dbg->getLocalNames(m);
+        d_dbg->getParamValues(thread, stack.first().id, !isStatic, params);
+        d_dbg->getLocalValues(thread, stack.first().id, locals);
+    } );
+    BENCH( "getFrameSnapshot",
+    {
+        d_dbg->resume();
+        const QList<Debugger::Frame> stack = d_dbg->getStack(thread);
+        d_dbg->getFrameSnapshot(thread, stack.first());
+    } );
+    BENCH( "locals sequence (cold)",
+    {
+        d_dbg->resume();
+        d_dbg->clearMetadataCache();
+        const QList<Debugger::Frame> stack = d_dbg->getStack(thread);
+        const quint32 m = stack.first().method;
+        const bool isStatic = d_dbg->isMethodStatic(m);
+        const quint16 params = d_dbg->getParamCount(m);
+        const quint16 locals = d_dbg->getLocalsCount(m);
+        d_dbg->getParamNames(m);
+        d_dbg->getLocalNames(m);
+        d_dbg->getParamValues(thread, stack.first().id, !isStatic, params);
+        d_dbg->getLocalValues(thread, stack.first().id, locals);
+    } );
+    BENCH( "getFrameSnapshot (cold)",
+    {
+        d_dbg->resume();
+        d_dbg->clearMetadataCache();
+        const QList<Debugger::Frame> stack = d_dbg->getStack(thread);
+        d_dbg->getFrameSnapshot(thread, stack.first());
+    } );
+
+    // event throughput
+    const int storm = 10000;
+    d_events = 0;
+    QElapsedTimer t;
+    t.start();
+    QMetaObject::invokeMethod( d_agent, "sendEventStorm", Qt::QueuedConnection,
+                               Q_ARG(int, DebuggerEvent::TYPE_LOAD), Q_ARG(int, storm), Q_ARG(int, 100) );
+    while( d_events < storm && t.elapsed() < 10000 )
+        QCoreApplication::processEvents();
+    report( "TYPE_LOAD events", d_events, t.nsecsElapsed() );
+
+    // tracepoint hits, each capturing two params and a local
+    Debugger::Tracepoint tp;
+    tp.message = "a=%1 b=%2 x=%3";
+    tp.params << 0 << 1;
+    tp.locals << 0;
+    const quint32 req = d_dbg->addTracepoint(method, 4, tp);
+    if( d_agent->getLastSuspendPolicy() != SUSPEND_POLICY_ALL )
+        qCritical() << "tracepoint requested with suspend policy" << d_agent->getLastSuspendPolicy();
+    QByteArray loc; // method id and il offset
+    for( int k = 3; k >= 0; k-- )
+        loc += char( method >> ( k * 8 ) );
+    loc += QByteArray(7,0);
+    loc += char(4);
+    QByteArray hits;
+    for( int k = 0; k < 100; k++ )
+        hits += FakeAgent::event(DebuggerEvent::BREAKPOINT, req, thread, loc);
+    const int traces = d_iterations * 10;
+    int records = 0;
+    const int resumes = d_agent->getResumeCount();
+    t.start();
+    for( int k = 0; k < traces; k += 100 )
+        QMetaObject::invokeMethod( d_agent, "sendEvents", Qt::QueuedConnection,
+                                   Q_ARG(QByteArray, hits), Q_ARG(int, 100), Q_ARG(int, SUSPEND_POLICY_ALL) );
+    while( records < traces && t.elapsed() < 10000 )
+    {
+        QCoreApplication::processEvents();
+        records += d_dbg->takeTraceRecords().size();
+    }
+    report( "tracepoint hits", records, t.nsecsElapsed() );
+    if( d_agent->getResumeCount() - resumes != ( traces + 99 ) / 100 )
+        qCritical() << "tracepoint packets resumed" << d_agent->getResumeCount() - resumes << "times";
+    d_dbg->removeTracepoint(req);
+
+    const Debugger::WaitStats ws = d_dbg->getWaitStats();
+    printf( "\nreplies %u, wake-up min %.1f avg %.1f max %.1f us, round trip min %.1f avg %.1f max %.1f us\n",
+            ws.count, ws.minWake / 1000.0, ws.sumWake / 1000.0 / qMax(ws.count,quint32(1)), ws.maxWake / 1000.0,
+            ws.minRtt / 1000.0, ws.sumRtt / 1000.0 / qMax(ws.count,quint32(1)), ws.maxRtt / 1000.0 );
+    printf( "late %u, orphans %u, reclaimed %u\n", ws.late, ws.orphans, ws.reclaimed );
+}
+
+void Bench::runWithoutFrameRanges()
+{
+    // the first partial getStack finds out that the agent rejects ranges; the others take them from the whole stack
+    const quint32 thread = 0x100;
+    const QList<Debugger::Frame> all = d_dbg->getStack(thread);
+    const QList<Debugger::Frame> part = d_dbg->getStack(thread, 2, 4);
+    if( d_dbg->hasFeature(Debugger::FrameRange) )
+        qCritical() << "frame ranges reported for an agent which rejects them";
+    bool same = part.size() == qMin( 4, qMax( all.size() - 2, 0 ) );
+    for( int j = 0; same && j < part.size(); j++ )
+        same = part[j].id == all[j + 2].id && part[j].method == all[j + 2].method;
+    if( !same )
+        qCritical() << "getStack(2, 4) without frame ranges differs from the whole stack";
+
+    printf( "%-28s %8s %12s %12s\n", "without frame ranges", "calls", "total ms", "us/call" );
+    BENCH( "getStack(range)", ( d_dbg->resume(), d_dbg->getStack(thread, 2, 4) ) );
+    BENCH( "getThreadSnapshot(1)", ( d_dbg->resume(), d_dbg->getThreadSnapshot(1) ) );
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    const QStringList args = a.arguments();
+    if( args.size() > 2 && args[1] == "-replay" )
+    {
+        const int iterations = args.size() > 3 ? args[3].toInt() : 100;
+        Bench bench(0, iterations); // the agent is not connected
+        QElapsedTimer t;
+        t.start();
+        for( int i = 0; i < iterations; i++ )
+        {
+            if( !bench.d_dbg->replay(args[2]) )
+                return -1;
+        }
+        bench.report( "replay", iterations, t.nsecsElapsed() );
+        printf( "%u events per replay\n", bench.d_events / qMax(iterations,1) );
+        return 0;
+    }
+    const int latency = args.size() > 1 ? args[1].toInt() : 0;
+    const int iterations = args.size() > 2 ? args[2].toInt() : 1000;
+
+    Bench bench(latency, iterations);
+    if( !bench.start() )
+    {
+        qCritical() << "cannot connect the fake agent";
+        return -1;
+    }
+    printf( "latency %d ms, %d iterations\n\n", latency, iterations );
+    bench.run();
+
+    Bench mono3(latency, iterations);
+    mono3.d_agent->setFrameRanges(false);
+    if( !mono3.start() )
+    {
+        qCritical() << "cannot connect the fake agent";
+        return -1;
+    }
+    printf( "\n" );
+    mono3.runWithoutFrameRanges();
+    return 0;
+}
+
+#include "MonoDebuggerBench.moc"
@@ -0,0 +1,18 @@
+QT       += core network
+QT       -= gui
+
+TARGET = MonoDebuggerBench
+TEMPLATE = app
+CONFIG += console
+
+INCLUDEPATH += ..
+
+SOURCES += MonoDebuggerBench.cpp \
+    MonoFakeAgent.cpp \
+    MonoDebugger.cpp
+
+HEADERS += \
+    MonoDebugger.h \
+    MonoFakeAgent.h \
+    MonoDebuggerPrivate.h \
+    MonoDebuggerCodec.h
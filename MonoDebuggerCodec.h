@@ -0,0 +1,541 @@
+#ifndef MONODEBUGGERCODEC_H
+#define MONODEBUGGERCODEC_H
+
+/*
+* Copyright 2021 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MonoTools library.
+*
+* The following is the license that applies to this copy of the
+* library. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MonoDebugger.h"
+#include "MonoDebuggerPrivate.h"
+#include <QByteArray>
+#include <QList>
+
+// Typed requests and replies of the soft debugger protocol, used by Debugger::call() and its cached variants.
+// A command declares the layout of its request and reply once with Command<>; encoding goes to a buffer reused
+// from call to call and decoding reports short or malformed replies by Decoder::ok() instead of throwing.
+// Fixed size parts of a reply are checked once with Decoder::need() and then read without further checks.
+
+namespace Mono
+{
+namespace Codec
+{
+    enum { HeaderSize = 11 };
+
+    class Encoder
+    {
+    public:
+        // the buffer keeps its capacity; the packet header is left free for Debugger
+        Encoder( QByteArray& buf, int header = HeaderSize ):d_buf(buf)
+        {
+            if( d_buf.capacity() < 256 )
+                d_buf.reserve(256);
+            d_buf.resize(header);
+        }
+        void u8( quint8 v ) { d_buf.append( char(v) ); }
+        void u32( quint32 v )
+        {
+            const char b[4] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+            d_buf.append( b, 4 );
+        }
+        void u64( quint64 v ) { u32( v >> 32 ); u32( v ); }
+        void str( const QByteArray& s ) { u32( s.size() ); d_buf.append( s ); }
+    private:
+        QByteArray& d_buf;
+    };
+
+    class Decoder // only keeps a pointer to the data
+    {
+    public:
+        Decoder( const QByteArray& data, int pos = 0 ):d_data((const quint8*)data.constData()),d_size(data.size()),
+            d_pos(pos),d_ok(pos >= 0 && pos <= data.size()) {}
+        bool ok() const { return d_ok; }
+        int pos() const { return d_pos; }
+        bool need( quint64 bytes ) // false and not ok if fewer bytes are left
+        {
+            if( d_ok && bytes > quint64( d_size - d_pos ) )
+                d_ok = false;
+            return d_ok;
+        }
+        // get8() and get32() don't check; only use them for bytes covered by a successful need()
+        quint8 get8() { return d_data[d_pos++]; }
+        quint32 get32()
+        {
+            const quint8* p = d_data + d_pos;
+            d_pos += 4;
+            return ( quint32(p[0]) << 24 ) | ( quint32(p[1]) << 16 ) | ( quint32(p[2]) << 8 ) | p[3];
+        }
+        void skip( quint64 bytes )
+        {
+            if( need(bytes) )
+                d_pos += bytes;
+        }
+        quint8 u8() { return need(1) ? get8() : 0; }
+        quint32 u32() { return need(4) ? get32() : 0; }
+        quint64 u64()
+        {
+            if( !need(8) )
+                return 0;
+            const quint64 h = get32();
+            return ( h << 32 ) | get32();
+        }
+        QByteArray str()
+        {
+            const quint32 len = u32();
+            if( !need(len) )
+                return QByteArray();
+            const QByteArray res( (const char*)d_data + d_pos, len );
+            d_pos += len;
+            return res;
+        }
+    private:
+        const quint8* d_data;
+        int d_size, d_pos;
+        bool d_ok;
+    };
+
+    template<quint8 S, quint8 C, class Req, class Rep>
+    struct Command
+    {
+        enum { Set = S, Cmd = C };
+        typedef Req Request;
+        typedef Rep Reply;
+    };
+
+    template<class Request>
+    inline QByteArray payload( const Request& r ) // without header, e.g. for Batch and the epoch cache
+    {
+        QByteArray res;
+        Encoder e(res, 0);
+        r.encode(e);
+        return res;
+    }
+
+    // requests
+
+    struct None
+    {
+        void encode( Encoder& ) const {}
+    };
+
+    struct Id
+    {
+        quint32 id;
+        Id( quint32 i ):id(i) {}
+        void encode( Encoder& e ) const { e.u32(id); }
+    };
+
+    struct Name // a string followed by an ignore case flag
+    {
+        QByteArray name;
+        bool ignoreCase;
+        Name( const QByteArray& n, bool ic = false ):name(n),ignoreCase(ic) {}
+        void encode( Encoder& e ) const { e.str(name); e.u8(ignoreCase); }
+    };
+
+    struct IdName
+    {
+        quint32 id;
+        Name name;
+        IdName( quint32 i, const QByteArray& n, bool ic = false ):id(i),name(n,ic) {}
+        void encode( Encoder& e ) const { e.u32(id); name.encode(e); }
+    };
+
+    struct FrameRange
+    {
+        quint32 thread, start;
+        qint32 length; // -1 for all frames
+        FrameRange( quint32 t, quint32 s = 0, qint32 l = -1 ):thread(t),start(s),length(l) {}
+        void encode( Encoder& e ) const { e.u32(thread); e.u32(start); e.u32(length); }
+    };
+
+    struct FrameId
+    {
+        quint32 thread, frame;
+        FrameId( quint32 t, quint32 f ):thread(t),frame(f) {}
+        void encode( Encoder& e ) const { e.u32(thread); e.u32(frame); }
+    };
+
+    struct FrameValues // params are at position -1 - index, locals at their index
+    {
+        quint32 thread, frame;
+        QList<qint32> positions;
+        FrameValues( quint32 t, quint32 f ):thread(t),frame(f) {}
+        void encode( Encoder& e ) const
+        {
+            e.u32(thread);
+            e.u32(frame);
+            e.u32(positions.size());
+            for( int i = 0; i < positions.size(); i++ )
+                e.u32(positions[i]);
+        }
+    };
+
+    struct FieldValues // of an object or type; the thread is only sent with CMD_TYPE_GET_VALUES_2
+    {
+        quint32 id, thread;
+        QList<quint32> fields;
+        FieldValues( quint32 i, const QList<quint32>& f, quint32 t = 0 ):id(i),thread(t),fields(f) {}
+        void encode( Encoder& e ) const
+        {
+            e.u32(id);
+            if( thread )
+                e.u32(thread);
+            e.u32(fields.size());
+            for( int i = 0; i < fields.size(); i++ )
+                e.u32(fields[i]);
+        }
+    };
+
+    struct MethodsByName // same set as CMD_TYPE_GET_METHODS, i.e. only the methods declared by the type
+    {
+        quint32 type;
+        QByteArray name;
+        MethodsByName( quint32 t, const QByteArray& n ):type(t),name(n) {}
+        void encode( Encoder& e ) const
+        {
+            e.u32(type);
+            e.str(name);
+            e.u32( BINDING_FLAGS_DECLARED_ONLY | BINDING_FLAGS_INSTANCE | BINDING_FLAGS_STATIC |
+                   BINDING_FLAGS_PUBLIC | BINDING_FLAGS_NON_PUBLIC );
+            e.u32( MLISTTYPE_CASE_SENSITIVE );
+        }
+    };
+
+    struct ArrayRange
+    {
+        quint32 id, index, count;
+        ArrayRange( quint32 i, quint32 from, quint32 n ):id(i),index(from),count(n) {}
+        void encode( Encoder& e ) const { e.u32(id); e.u32(index); e.u32(count); }
+    };
+
+    struct EventSet // with at most one modifier
+    {
+        quint8 kind, policy, modifier; // modifier 0 is none
+        quint32 id; // method, thread or exception type
+        quint64 offset; // il offset of MOD_KIND_LOCATION_ONLY
+        quint32 size, depth; // of MOD_KIND_STEP
+        bool caught, uncaught, subclasses; // of MOD_KIND_EXCEPTION_ONLY
+        EventSet( quint8 k, quint8 p ):kind(k),policy(p),modifier(0),id(0),offset(0),size(0),depth(0),
+            caught(false),uncaught(false),subclasses(false) {}
+        void encode( Encoder& e ) const
+        {
+            e.u8(kind);
+            e.u8(policy);
+            e.u8(modifier != 0);
+            if( modifier == 0 )
+                return;
+            e.u8(modifier);
+            e.u32(id);
+            switch( modifier )
+            {
+            case MOD_KIND_LOCATION_ONLY:
+                e.u64(offset);
+                break;
+            case MOD_KIND_STEP:
+                e.u32(size);
+                e.u32(depth);
+                e.u32(0); // filter
+                break;
+            case MOD_KIND_EXCEPTION_ONLY:
+                e.u8(caught);
+                e.u8(uncaught);
+                e.u8(subclasses);
+                break;
+            }
+        }
+    };
+
+    struct EventClear
+    {
+        quint8 kind;
+        quint32 id;
+        EventClear( quint8 k, quint32 i ):kind(k),id(i) {}
+        void encode( Encoder& e ) const { e.u8(kind); e.u32(id); }
+    };
+
+    // replies
+
+    struct Empty
+    {
+        void decode( Decoder& ) {}
+    };
+
+    struct U32
+    {
+        quint32 value;
+        U32():value(0) {}
+        void decode( Decoder& d ) { value = d.u32(); }
+    };
+
+    struct U64
+    {
+        quint64 value;
+        U64():value(0) {}
+        void decode( Decoder& d ) { value = d.u64(); }
+    };
+
+    struct String
+    {
+        QByteArray value;
+        void decode( Decoder& d ) { value = d.str(); }
+    };
+
+    struct IdList
+    {
+        QList<quint32> ids;
+        void decode( Decoder& d )
+        {
+            const quint32 count = d.u32();
+            if( !d.need( quint64(count) * 4 ) ) // the whole list is checked once
+                return;
+            ids.reserve(count);
+            for( quint32 i = 0; i < count; i++ )
+                ids << d.get32();
+        }
+    };
+
+    struct Frames
+    {
+        QList<Debugger::Frame> frames;
+        void decode( Decoder& d )
+        {
+            const quint32 count = d.u32();
+            if( !d.need( quint64(count) * 13 ) )
+                return;
+            frames.reserve(count);
+            for( quint32 i = 0; i < count; i++ )
+            {
+                Debugger::Frame f;
+                f.id = d.get32();
+                f.method = d.get32();
+                f.il_offset = d.get32();
+                f.flags = d.get8();
+                frames << f;
+            }
+        }
+    };
+
+    struct Bounds
+    {
+        Debugger::ArrayBounds bounds;
+        void decode( Decoder& d )
+        {
+            const quint32 rank = d.u32();
+            if( !d.need( quint64(rank) * 8 ) )
+                return;
+            for( quint32 i = 0; i < rank; i++ )
+            {
+                bounds.lengths << d.get32();
+                bounds.lowerBounds << qint32(d.get32());
+            }
+        }
+    };
+
+    struct MethodInfo // the part of CMD_METHOD_GET_INFO used by Debugger
+    {
+        quint32 flags, implFlags, token;
+        MethodInfo():flags(0),implFlags(0),token(0) {}
+        void decode( Decoder& d )
+        {
+            if( !d.need(12) )
+                return;
+            flags = d.get32();
+            implFlags = d.get32();
+            token = d.get32();
+        }
+    };
+
+    struct DebugInfo
+    {
+        Debugger::MethodDbgInfo info;
+        DebugInfo() { info.codeSize = 0; }
+        void decode( Decoder& d )
+        {
+            info.codeSize = d.u32();
+            const quint32 files = d.u32();
+            for( quint32 i = 0; i < files && d.ok(); i++ )
+            {
+                info.sourceFile = d.str();
+                d.skip(16); // hash
+            }
+            const quint32 count = d.u32(); // number of il offsets
+            if( !d.need( quint64(count) * 24 ) )
+                return;
+            info.lines.reserve(count);
+            for( quint32 i = 0; i < count; i++ )
+            {
+                Debugger::MethodDbgInfo::Loc loc;
+                loc.valid = true;
+                loc.iloff = d.get32();
+                loc.row = d.get32();
+                d.get32(); // source
+                loc.col = (int)d.get32(); // can be negative
+                d.get32(); // end line
+                d.get32(); // end column
+                info.lines << loc;
+            }
+        }
+    };
+
+    struct ParamInfo
+    {
+        quint32 callConv, generic, ret;
+        QList<quint32> types;
+        QByteArrayList names;
+        ParamInfo():callConv(0),generic(0),ret(0) {}
+        void decode( Decoder& d )
+        {
+            if( !d.need(16) )
+                return;
+            callConv = d.get32();
+            const quint32 count = d.get32();
+            generic = d.get32();
+            ret = d.get32();
+            if( !d.need( quint64(count) * 8 ) ) // the types and at least the lengths of the names
+                return;
+            types.reserve(count);
+            for( quint32 i = 0; i < count; i++ )
+                types << d.get32();
+            for( quint32 i = 0; i < count && d.ok(); i++ )
+                names << d.str();
+        }
+    };
+
+    struct LocalsInfo
+    {
+        QList<quint32> types;
+        QByteArrayList names;
+        void decode( Decoder& d )
+        {
+            const quint32 count = d.u32();
+            if( !d.need( quint64(count) * 8 ) )
+                return;
+            types.reserve(count);
+            for( quint32 i = 0; i < count; i++ )
+                types << d.get32();
+            for( quint32 i = 0; i < count && d.ok(); i++ )
+                names << d.str();
+        }
+    };
+
+    struct TypeInfo
+    {
+        Debugger::TypeInfo info;
+        TypeInfo() { info.assembly = info.module = info.id = 0; }
+        void decode( Decoder& d )
+        {
+            info.space = d.str();
+            info.name = d.str();
+            info.fullName = d.str();
+            if( !d.need(12) )
+                return;
+            info.assembly = d.get32();
+            info.module = d.get32();
+            info.id = d.get32();
+        }
+    };
+
+    struct Fields
+    {
+        QList<Debugger::FieldInfo> fields;
+        QList<quint32> attrs;
+        void decode( Decoder& d )
+        {
+            const quint32 count = d.u32();
+            for( quint32 i = 0; i < count && d.ok(); i++ )
+            {
+                Debugger::FieldInfo f;
+                f.id = d.u32();
+                f.name = d.str();
+                d.skip(4); // type
+                const quint32 a = d.u32();
+                if( !d.ok() )
+                    return;
+                fields << f;
+                attrs << a;
+            }
+        }
+    };
+
+    struct ModuleInfo
+    {
+        QByteArray baseName, scopeName, fullName, guid; // fullName is the path of the module file
+        void decode( Decoder& d )
+        {
+            baseName = d.str();
+            scopeName = d.str();
+            fullName = d.str();
+            guid = d.str();
+        }
+    };
+
+    struct Version
+    {
+        QByteArray name;
+        quint32 major, minor;
+        Version():major(0),minor(0) {}
+        void decode( Decoder& d )
+        {
+            name = d.str();
+            major = d.u32();
+            minor = d.u32();
+        }
+    };
+
+    // commands
+
+    typedef Command<CMD_SET_VM, CMD_VM_VERSION, None, Version> VmVersion;
+    typedef Command<CMD_SET_VM, CMD_VM_ALL_THREADS, None, IdList> VmAllThreads;
+    typedef Command<CMD_SET_VM, CMD_VM_GET_TYPES, Name, IdList> VmGetTypes;
+    typedef Command<CMD_SET_VM, CMD_VM_GET_TYPES_FOR_SOURCE_FILE, Name, IdList> VmGetTypesForSourceFile;
+    typedef Command<CMD_SET_THREAD, CMD_THREAD_GET_NAME, Id, String> ThreadGetName;
+    typedef Command<CMD_SET_THREAD, CMD_THREAD_GET_STATE, Id, U32> ThreadGetState;
+    typedef Command<CMD_SET_APPDOMAIN, CMD_APPDOMAIN_GET_CORLIB, Id, U32> AppDomainGetCorlib;
+    typedef Command<CMD_SET_ASSEMBLY, CMD_ASSEMBLY_GET_TYPE, IdName, U32> AssemblyGetType;
+    typedef Command<CMD_SET_ASSEMBLY, CMD_ASSEMBLY_GET_NAME, Id, String> AssemblyGetName;
+    typedef Command<CMD_SET_ASSEMBLY, CMD_ASSEMBLY_GET_MANIFEST_MODULE, Id, U32> AssemblyGetManifestModule;
+    typedef Command<CMD_SET_MODULE, CMD_MODULE_GET_INFO, Id, ModuleInfo> ModuleGetInfo;
+    typedef Command<CMD_SET_OBJECT_REF, CMD_OBJECT_REF_IS_COLLECTED, Id, U32> ObjectIsCollected;
+    typedef Command<CMD_SET_OBJECT_REF, CMD_OBJECT_REF_GET_TYPE, Id, U32> ObjectGetType;
+    typedef Command<CMD_SET_THREAD, CMD_THREAD_GET_FRAME_INFO, FrameRange, Frames> ThreadGetFrameInfo;
+    // the values of these are decoded by ValueBuffer
+    typedef Command<CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_VALUES, FrameValues, Empty> FrameGetValues;
+    typedef Command<CMD_SET_STACK_FRAME, CMD_STACK_FRAME_GET_THIS, FrameId, Empty> FrameGetThis;
+    typedef Command<CMD_SET_OBJECT_REF, CMD_OBJECT_REF_GET_VALUES, FieldValues, Empty> ObjectGetValues;
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_VALUES, FieldValues, Empty> TypeGetValues;
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_VALUES_2, FieldValues, Empty> TypeGetValues2;
+    typedef Command<CMD_SET_ARRAY_REF, CMD_ARRAY_REF_GET_VALUES, ArrayRange, Empty> ArrayGetValues;
+    typedef Command<CMD_SET_ARRAY_REF, CMD_ARRAY_REF_GET_LENGTH, Id, Bounds> ArrayGetLength;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_NAME, Id, String> MethodGetName;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_INFO, Id, MethodInfo> MethodGetInfo;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_DECLARING_TYPE, Id, U32> MethodGetDeclaringType;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_DEBUG_INFO, Id, DebugInfo> MethodGetDebugInfo;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_PARAM_INFO, Id, ParamInfo> MethodGetParamInfo;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_LOCALS_INFO, Id, LocalsInfo> MethodGetLocalsInfo;
+    typedef Command<CMD_SET_METHOD, CMD_METHOD_GET_BODY, Id, String> MethodGetBody; // the IL as length and bytes
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_INFO, Id, TypeInfo> TypeGetInfo;
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_OBJECT, Id, U32> TypeGetObject;
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_FIELDS, Id, Fields> TypeGetFields;
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_METHODS, Id, IdList> TypeGetMethods;
+    typedef Command<CMD_SET_TYPE, CMD_TYPE_GET_METHODS_BY_NAME_FLAGS, MethodsByName, IdList> TypeGetMethodsByNameFlags;
+    typedef Command<CMD_SET_EVENT_REQUEST, CMD_EVENT_REQUEST_SET, EventSet, U32> EventRequestSet;
+    typedef Command<CMD_SET_EVENT_REQUEST, CMD_EVENT_REQUEST_CLEAR, EventClear, Empty> EventRequestClear;
+}
+}
+
+#endif // MONODEBUGGERCODEC_H
@@ -17,6 +17,7 @@ HEADERS += \
     MonoEngine.h \
     MonoDebugger.h \
     DebuggerGui.h \
-    MonoDebuggerPrivate.h
+    MonoDebuggerPrivate.h \
+    MonoDebuggerCodec.h
 
 include( ../GuiTools/Menu.pri )
@@ -126,6 +126,21 @@ enum InvokeFlags {
     INVOKE_FLAG_VIRTUAL = 16
 };
 
+// System.Reflection.BindingFlags and MonoDebugger's MemberListType, for CMD_TYPE_GET_METHODS_BY_NAME_FLAGS
+enum BindingFlags {
+    BINDING_FLAGS_DECLARED_ONLY = 2,
+    BINDING_FLAGS_INSTANCE = 4,
+    BINDING_FLAGS_STATIC = 8,
+    BINDING_FLAGS_PUBLIC = 16,
+    BINDING_FLAGS_NON_PUBLIC = 32
+};
+
+enum MemberListType {
+    MLISTTYPE_ALL = 0,
+    MLISTTYPE_CASE_SENSITIVE = 1,
+    MLISTTYPE_CASE_INSENSITIVE = 2
+};
+
 enum MonoThreadState {
     ThreadState_Running = 0x00000000,
     ThreadState_StopRequested = 0x00000001,
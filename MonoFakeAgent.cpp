@@ -0,0 +1,569 @@
+/*
+* Copyright 2021 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MonoTools library.
+*
+* The following is the license that applies to this copy of the
+* library. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "MonoFakeAgent.h"
+#include "MonoDebugger.h"
+#include "MonoDebuggerPrivate.h"
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtDebug>
+using namespace Mono;
+
+// ids handed out by the fake VM
+enum { ThreadBase = 0x100, AssemblyId = 0x10, ModuleId = 0x11, DomainId = 0x12,
+       MethodBase = 0x2000, TypeBase = 0x3000, FieldBase = 0x4000, ObjectBase = 0x5000, StringBase = 0x6000 };
+
+static inline quint32 readUint32( const char* buf )
+{
+    return (((quint8)buf[0]) << 24) | (((quint8)buf[1]) << 16) |
+            (((quint8)buf[2]) << 8) | (((quint8)buf[3]) << 0);
+}
+
+static inline void writeUint32( char* buf, quint32 val )
+{
+    buf[0] = (val >> 24) & 0xff;
+    buf[1] = (val >> 16) & 0xff;
+    buf[2] = (val >> 8) & 0xff;
+    buf[3] = (val >> 0) & 0xff;
+}
+
+static inline void addByte( QByteArray& out, quint8 val )
+{
+    out += char(val);
+}
+
+static inline void addInt( QByteArray& out, quint32 val )
+{
+    char buf[4];
+    writeUint32(buf,val);
+    out.append(buf,4);
+}
+
+static inline void addLong( QByteArray& out, quint64 val )
+{
+    addInt(out, val >> 32);
+    addInt(out, val & 0xffffffff);
+}
+
+static inline void addString( QByteArray& out, const QByteArray& str )
+{
+    addInt(out,str.size());
+    out += str;
+}
+
+static inline void addI4Value( QByteArray& out, quint32 val )
+{
+    addByte(out, VT_I4);
+    addInt(out, val);
+}
+
+static inline quint32 argAt( const QByteArray& req, int off )
+{
+    if( req.size() < off + 4 )
+        return 0;
+    return readUint32(req.constData() + off);
+}
+
+FakeAgent::FakeAgent(QObject *parent) : QObject(parent),d_sock(0),d_latency(0),d_frameRanges(true),d_nextId(1)
+{
+    d_timer = new QTimer(this);
+    d_timer->setSingleShot(true);
+    connect( d_timer, SIGNAL(timeout()), this, SLOT(onTimer()) );
+    d_clock.start();
+}
+
+void FakeAgent::setReply(quint8 cmdSet, quint8 cmd, const QByteArray& payload, quint8 err)
+{
+    d_script.insert( ( quint16(cmdSet) << 8 ) | cmd, qMakePair(err,payload) );
+}
+
+QByteArray FakeAgent::event(quint8 kind, quint32 request, quint32 thread, const QByteArray& data)
+{
+    QByteArray res;
+    addByte(res, kind);
+    addInt(res, request);
+    addInt(res, thread);
+    res += data;
+    return res;
+}
+
+void FakeAgent::connectTo(quint16 port)
+{
+    if( d_sock )
+        return;
+    d_sock = new QTcpSocket(this);
+    connect( d_sock, SIGNAL(readyRead()), this, SLOT(onData()) );
+    d_sock->connectToHost(QHostAddress::LocalHost, port);
+    if( !d_sock->waitForConnected() )
+    {
+        qCritical() << "FakeAgent cannot connect:" << d_sock->errorString();
+        return;
+    }
+    d_sock->write("DWP-Handshake");
+}
+
+void FakeAgent::sendEvents(const QByteArray& events, int count, int policy)
+{
+    QByteArray payload;
+    addByte(payload, policy);
+    addInt(payload, count);
+    payload += events;
+    QByteArray packet(11,0);
+    writeUint32(packet.data(), 11 + payload.size());
+    writeUint32(packet.data() + 4, d_nextId++);
+    packet[9] = CMD_SET_EVENT;
+    packet[10] = CMD_COMPOSITE;
+    send(packet + payload);
+}
+
+void FakeAgent::sendEventStorm(int kind, int count, int perPacket)
+{
+    QByteArray data;
+    addInt(data, TypeBase);
+    int n = 0;
+    QByteArray events;
+    for( int i = 0; i < count; i++ )
+    {
+        const bool noData = kind == DebuggerEvent::THREAD_START || kind == DebuggerEvent::THREAD_DEATH;
+        events += event(kind, 0, ThreadBase, noData ? QByteArray() : data );
+        if( ++n == perPacket )
+        {
+            sendEvents(events, n);
+            events.clear();
+            n = 0;
+        }
+    }
+    if( n )
+        sendEvents(events, n);
+}
+
+void FakeAgent::disconnectFromDebugger()
+{
+    if( d_sock )
+        d_sock->disconnectFromHost();
+}
+
+void FakeAgent::onData()
+{
+    d_in += d_sock->readAll();
+    if( d_ready.load() == 0 )
+    {
+        if( d_in.size() < 13 )
+            return;
+        if( d_in.left(13) != "DWP-Handshake" )
+        {
+            qCritical() << "FakeAgent: invalid handshake";
+            d_sock->close();
+            return;
+        }
+        d_in = d_in.mid(13);
+        d_ready.store(1);
+        QByteArray domain;
+        addInt(domain, DomainId);
+        sendEvents( event(DebuggerEvent::VM_START, 0, ThreadBase, domain), 1 );
+    }
+    int off = 0;
+    while( d_in.size() - off >= 11 )
+    {
+        const char* h = d_in.constData() + off;
+        const quint32 len = readUint32(h);
+        if( len < 11 )
+        {
+            qCritical() << "FakeAgent: invalid packet length";
+            d_sock->close();
+            return;
+        }
+        if( quint32(d_in.size() - off) < len )
+            break;
+        const quint32 id = readUint32(h + 4);
+        const quint8 cmdSet = h[9];
+        const quint8 cmd = h[10];
+        const QByteArray req = d_in.mid(off + 11, len - 11);
+        off += len;
+        d_requests.ref();
+
+        quint8 err = 0;
+        QByteArray payload;
+        QHash<quint16, QPair<quint8,QByteArray> >::const_iterator i = d_script.find( ( quint16(cmdSet) << 8 ) | cmd );
+        if( i != d_script.end() )
+        {
+            err = i.value().first;
+            payload = i.value().second;
+        }else
+            payload = generate(cmdSet, cmd, req, err);
+        reply(id, err, payload);
+    }
+    d_in = d_in.mid(off);
+}
+
+void FakeAgent::onTimer()
+{
+    const qint64 now = d_clock.elapsed();
+    while( !d_out.isEmpty() && d_out.first().d_due <= now )
+        send( d_out.takeFirst().d_packet );
+    if( !d_out.isEmpty() )
+        d_timer->start( d_out.first().d_due - now );
+}
+
+void FakeAgent::reply(quint32 id, quint8 err, const QByteArray& payload)
+{
+    QByteArray packet(11,0);
+    writeUint32(packet.data(), 11 + payload.size());
+    writeUint32(packet.data() + 4, id);
+    packet[8] = char(0x80);
+    packet[9] = 0;
+    packet[10] = err;
+    packet += payload;
+    if( d_latency <= 0 )
+    {
+        send(packet);
+        return;
+    }
+    // replies overlap like on a real link, i.e. pipelined requests don't accumulate the latency
+    Out o;
+    o.d_due = d_clock.elapsed() + d_latency;
+    o.d_packet = packet;
+    d_out.append(o);
+    if( !d_timer->isActive() )
+        d_timer->start(d_latency);
+}
+
+void FakeAgent::send(const QByteArray& packet)
+{
+    if( d_sock && d_sock->isOpen() )
+        d_sock->write(packet);
+}
+
+QByteArray FakeAgent::generate(quint8 cmdSet, quint8 cmd, const QByteArray& req, quint8& err)
+{
+    QByteArray out;
+    const quint32 arg0 = argAt(req,0);
+    switch( cmdSet )
+    {
+    case CMD_SET_VM:
+        switch( cmd )
+        {
+        case CMD_VM_VERSION:
+            addString(out, "FakeAgent");
+            addInt(out, MAJOR_VERSION);
+            addInt(out, MINOR_VERSION);
+            return out;
+        case CMD_VM_ALL_THREADS:
+            addInt(out, d_sizes.threads);
+            for( quint32 i = 0; i < d_sizes.threads; i++ )
+                addInt(out, ThreadBase + i);
+            return out;
+        case CMD_VM_RESUME:
+            d_resumes.ref();
+            return out;
+        case CMD_VM_SUSPEND:
+        case CMD_VM_EXIT:
+        case CMD_VM_SET_PROTOCOL_VERSION:
+        case CMD_VM_SET_KEEPALIVE:
+            return out;
+        case CMD_VM_GET_TYPES:
+        case CMD_VM_GET_TYPES_FOR_SOURCE_FILE:
+            addInt(out, 1);
+            addInt(out, TypeBase);
+            return out;
+        }
+        break;
+    case CMD_SET_EVENT_REQUEST:
+        switch( cmd )
+        {
+        case CMD_EVENT_REQUEST_SET:
+            if( req.size() > 1 )
+                d_policy.store((quint8)req[1]);
+            addInt(out, d_nextId++);
+            return out;
+        case CMD_EVENT_REQUEST_CLEAR:
+        case CMD_EVENT_REQUEST_CLEAR_ALL_BREAKPOINTS:
+            return out;
+        }
+        break;
+    case CMD_SET_THREAD:
+        switch( cmd )
+        {
+        case CMD_THREAD_GET_FRAME_INFO:
+            if( !d_frameRanges && ( argAt(req,4) != 0 || argAt(req,8) != quint32(-1) ) )
+                break; // only the whole stack
+            {
+                const quint32 start = qMin( argAt(req,4), d_sizes.frames );
+                quint32 len = argAt(req,8);
+                if( len == quint32(-1) || start + len > d_sizes.frames )
+                    len = d_sizes.frames - start;
+                addInt(out, len);
+                for( quint32 i = start; i < start + len; i++ )
+                {
+                    addInt(out, i + 1); // frame id
+                    addInt(out, MethodBase + i % d_sizes.methods);
+                    addInt(out, i * 4); // il offset
+                    addByte(out, 0);
+                }
+            }
+            return out;
+        case CMD_THREAD_GET_NAME:
+            addString(out, "Thread " + QByteArray::number(arg0 - ThreadBase));
+            return out;
+        case CMD_THREAD_GET_STATE:
+            addInt(out, ThreadState_Suspended);
+            return out;
+        case CMD_THREAD_GET_INFO:
+            addByte(out, 0); // is thread pool
+            return out;
+        case CMD_THREAD_GET_ID:
+        case CMD_THREAD_GET_TID:
+            addLong(out, arg0);
+            return out;
+        }
+        break;
+    case CMD_SET_APPDOMAIN:
+        switch( cmd )
+        {
+        case CMD_APPDOMAIN_GET_ROOT_DOMAIN:
+            addInt(out, DomainId);
+            return out;
+        case CMD_APPDOMAIN_GET_CORLIB:
+            addInt(out, AssemblyId);
+            return out;
+        }
+        break;
+    case CMD_SET_ASSEMBLY:
+        switch( cmd )
+        {
+        case CMD_ASSEMBLY_GET_TYPE:
+            addInt(out, TypeBase);
+            return out;
+        case CMD_ASSEMBLY_GET_NAME:
+            addString(out, "FakeAssembly, Version=0.0.0.0, Culture=neutral, PublicKeyToken=null");
+            return out;
+        case CMD_ASSEMBLY_GET_LOCATION:
+            addString(out, "/tmp/FakeAssembly.dll");
+            return out;
+        case CMD_ASSEMBLY_GET_MANIFEST_MODULE:
+            addInt(out, ModuleId);
+            return out;
+        }
+        break;
+    case CMD_SET_MODULE:
+        if( cmd == CMD_MODULE_GET_INFO )
+        {
+            addString(out, "FakeAssembly.dll");
+            addString(out, "FakeAssembly.dll");
+            addString(out, "/tmp/FakeAssembly.dll");
+            addString(out, "00000000-0000-0000-0000-000000000000");
+            addInt(out, AssemblyId);
+            return out;
+        }
+        break;
+    case CMD_SET_STACK_FRAME:
+        switch( cmd )
+        {
+        case CMD_STACK_FRAME_GET_THIS:
+            addByte(out, VT_Class);
+            addInt(out, ObjectBase);
+            return out;
+        case CMD_STACK_FRAME_GET_VALUES:
+            {
+                const quint32 count = argAt(req,8);
+                for( quint32 i = 0; i < count; i++ )
+                    addI4Value(out, i);
+            }
+            return out;
+        }
+        break;
+    case CMD_SET_STRING_REF:
+        switch( cmd )
+        {
+        case CMD_STRING_REF_GET_VALUE:
+            addString(out, QByteArray(d_sizes.stringLen, 'x'));
+            return out;
+        case CMD_STRING_REF_GET_LENGTH:
+            addLong(out, d_sizes.stringLen);
+            return out;
+        case CMD_STRING_REF_GET_CHARS:
+            {
+                const quint32 len = argAt(req,16); // id, long index, long length
+                for( quint32 i = 0; i < len; i++ )
+                {
+                    addByte(out, 0);
+                    addByte(out, 'x');
+                }
+            }
+            return out;
+        }
+        break;
+    case CMD_SET_ARRAY_REF:
+        switch( cmd )
+        {
+        case CMD_ARRAY_REF_GET_LENGTH:
+            addInt(out, 1); // rank
+            addInt(out, d_sizes.arrayLen);
+            addInt(out, 0); // lower bound
+            return out;
+        case CMD_ARRAY_REF_GET_VALUES:
+            {
+                const quint32 index = argAt(req,4);
+                const quint32 len = argAt(req,8);
+                for( quint32 i = 0; i < len; i++ )
+                    addI4Value(out, index + i);
+            }
+            return out;
+        }
+        break;
+    case CMD_SET_METHOD:
+        switch( cmd )
+        {
+        case CMD_METHOD_GET_NAME:
+            addString(out, "method" + QByteArray::number(arg0 - MethodBase));
+            return out;
+        case CMD_METHOD_GET_DECLARING_TYPE:
+            addInt(out, TypeBase + ( arg0 - MethodBase ) % 4);
+            return out;
+        case CMD_METHOD_GET_DEBUG_INFO:
+            addInt(out, d_sizes.lines * 4); // code size
+            addInt(out, 1);
+            addString(out, "/tmp/Fake.obx");
+            out += QByteArray(16,0); // hash
+            addInt(out, d_sizes.lines);
+            for( quint32 i = 0; i < d_sizes.lines; i++ )
+            {
+                addInt(out, i * 4); // il offset
+                addInt(out, i + 10); // line
+                addInt(out, 0); // source
+                addInt(out, 1); // column
+                addInt(out, i + 10); // end line
+                addInt(out, 20); // end column
+            }
+            return out;
+        case CMD_METHOD_GET_PARAM_INFO:
+            addInt(out, 0); // calling convention
+            addInt(out, d_sizes.params);
+            addInt(out, 0); // generic params
+            addInt(out, TypeBase); // return type
+            for( quint32 i = 0; i < d_sizes.params; i++ )
+                addInt(out, TypeBase);
+            for( quint32 i = 0; i < d_sizes.params; i++ )
+                addString(out, "p" + QByteArray::number(i));
+            return out;
+        case CMD_METHOD_GET_LOCALS_INFO:
+            addInt(out, d_sizes.locals);
+            for( quint32 i = 0; i < d_sizes.locals; i++ )
+                addInt(out, TypeBase);
+            for( quint32 i = 0; i < d_sizes.locals; i++ )
+                addString(out, "l" + QByteArray::number(i));
+            for( quint32 i = 0; i < d_sizes.locals; i++ )
+            {
+                addInt(out, 0); // live range
+                addInt(out, d_sizes.lines * 4);
+            }
+            return out;
+        case CMD_METHOD_GET_INFO:
+            addInt(out, ( arg0 - MethodBase ) % 2 ? METHOD_ATTRIBUTE_STATIC : 0);
+            addInt(out, METHOD_IMPL_ATTRIBUTE_IL);
+            addInt(out, 0x06000001 + arg0 - MethodBase); // token
+            return out;
+        case CMD_METHOD_GET_BODY:
+            addInt(out, 64);
+            out += QByteArray(63, 0); // nop
+            addByte(out, 0x2a); // ret
+            return out;
+        }
+        break;
+    case CMD_SET_TYPE:
+        switch( cmd )
+        {
+        case CMD_TYPE_GET_INFO:
+            addString(out, "Fake");
+            addString(out, "Type" + QByteArray::number(arg0 - TypeBase));
+            addString(out, "Fake.Type" + QByteArray::number(arg0 - TypeBase));
+            addInt(out, AssemblyId);
+            addInt(out, ModuleId);
+            addInt(out, arg0);
+            return out;
+        case CMD_TYPE_GET_OBJECT:
+            addInt(out, ObjectBase + 1);
+            return out;
+        case CMD_TYPE_GET_METHODS:
+            addInt(out, d_sizes.methods);
+            for( quint32 i = 0; i < d_sizes.methods; i++ )
+                addInt(out, MethodBase + i);
+            return out;
+        case CMD_TYPE_GET_METHODS_BY_NAME_FLAGS:
+            {
+                const QByteArray name = req.mid(8, argAt(req,4)); // after the type id
+                QList<quint32> found;
+                for( quint32 i = 0; i < d_sizes.methods; i++ )
+                {
+                    if( name == "method" + QByteArray::number(i) )
+                        found << MethodBase + i;
+                }
+                addInt(out, found.size());
+                for( int i = 0; i < found.size(); i++ )
+                    addInt(out, found[i]);
+            }
+            return out;
+        case CMD_TYPE_GET_FIELDS:
+            addInt(out, d_sizes.fields);
+            for( quint32 i = 0; i < d_sizes.fields; i++ )
+            {
+                addInt(out, FieldBase + i);
+                addString(out, "f" + QByteArray::number(i));
+                addInt(out, TypeBase);
+                addInt(out, i % 4 == 3 ? FIELD_ATTRIBUTE_STATIC : 0);
+            }
+            return out;
+        case CMD_TYPE_GET_VALUES:
+            {
+                const quint32 count = argAt(req,4);
+                for( quint32 i = 0; i < count; i++ )
+                    addI4Value(out, i);
+            }
+            return out;
+        case CMD_TYPE_GET_VALUES_2:
+            {
+                const quint32 count = argAt(req,8); // type, thread, count
+                for( quint32 i = 0; i < count; i++ )
+                    addI4Value(out, i);
+            }
+            return out;
+        }
+        break;
+    case CMD_SET_OBJECT_REF:
+        switch( cmd )
+        {
+        case CMD_OBJECT_REF_GET_TYPE:
+            addInt(out, TypeBase);
+            return out;
+        case CMD_OBJECT_REF_GET_VALUES:
+            {
+                const quint32 count = argAt(req,4);
+                for( quint32 i = 0; i < count; i++ )
+                    addI4Value(out, i);
+            }
+            return out;
+        case CMD_OBJECT_REF_IS_COLLECTED:
+            addInt(out, 0);
+            return out;
+        }
+        break;
+    }
+    err = ERR_NOT_IMPLEMENTED;
+    return out;
+}
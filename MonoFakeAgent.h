@@ -0,0 +1,95 @@
+#ifndef MONOFAKEAGENT_H
+#define MONOFAKEAGENT_H
+
+/*
+* Copyright 2021 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the MonoTools library.
+*
+* The following is the license that applies to this copy of the
+* library. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QObject>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+
+class QTcpSocket;
+class QTimer;
+
+namespace Mono
+{
+    // Stand-in for the soft debugger agent of the Mono runtime, used to benchmark Debugger without Mono.
+    // Connects to the port returned by Debugger::open(), sends VM_START and answers the requests with
+    // generated or scripted replies. Must live in its own thread because Debugger blocks while waiting for replies.
+    class FakeAgent : public QObject
+    {
+        Q_OBJECT
+    public:
+        explicit FakeAgent(QObject *parent = 0);
+
+        struct Sizes
+        {
+            quint32 threads, frames, methods, fields, params, locals, lines, stringLen, arrayLen;
+            Sizes():threads(4),frames(16),methods(32),fields(8),params(3),locals(8),lines(20),
+                stringLen(64),arrayLen(100){}
+        };
+        void setSizes( const Sizes& s ) { d_sizes = s; }
+        const Sizes& getSizes() const { return d_sizes; }
+        void setLatency( int msecs ) { d_latency = msecs; } // from the receipt of a request to its reply
+        void setReply( quint8 cmdSet, quint8 cmd, const QByteArray& payload, quint8 err = 0 ); // instead of generated
+        // false rejects ranged CMD_THREAD_GET_FRAME_INFO with NOT_IMPLEMENTED, like the agent of Mono 3
+        void setFrameRanges( bool on ) { d_frameRanges = on; }
+        bool isReady() const { return d_ready.load() != 0; } // handshake done
+        int getRequestCount() const { return d_requests.load(); }
+        int getLastSuspendPolicy() const { return d_policy.load(); } // of the last CMD_EVENT_REQUEST_SET
+        int getResumeCount() const { return d_resumes.load(); }
+
+        static QByteArray event( quint8 kind, quint32 request, quint32 thread, const QByteArray& data = QByteArray() );
+    public slots:
+        void connectTo( quint16 port );
+        void sendEvents( const QByteArray& events, int count, int policy = 0 ); // one CMD_COMPOSITE packet
+        void sendEventStorm( int kind, int count, int perPacket ); // kinds with one id or none, like TYPE_LOAD
+        void disconnectFromDebugger();
+    protected slots:
+        void onData();
+        void onTimer();
+    protected:
+        QByteArray generate( quint8 cmdSet, quint8 cmd, const QByteArray& req, quint8& err );
+        void reply( quint32 id, quint8 err, const QByteArray& payload );
+        void send( const QByteArray& packet );
+    private:
+        QTcpSocket* d_sock;
+        QTimer* d_timer;
+        QElapsedTimer d_clock;
+        QByteArray d_in;
+        struct Out
+        {
+            qint64 d_due; // msecs on d_clock
+            QByteArray d_packet;
+        };
+        QList<Out> d_out;
+        QHash<quint16, QPair<quint8,QByteArray> > d_script; // cmdSet << 8 | cmd -> err, reply
+        Sizes d_sizes;
+        int d_latency;
+        bool d_frameRanges;
+        quint32 d_nextId; // of events and event requests
+        QAtomicInt d_ready;
+        QAtomicInt d_requests;
+        QAtomicInt d_policy;
+        QAtomicInt d_resumes;
+    };
+}
+
+#endif // MONOFAKEAGENT_H